@@ -0,0 +1,246 @@
+// Round trips random images through the codecs and checks that the vectorised
+// kernels agree with the scalar ones. Built and run by `make check`.
+#define main tpe_main
+#include "tpe.c"
+#undef main
+
+static int failures;
+static char path[] = "/tmp/tpe-test-XXXXXX";
+
+static void
+check(int ok, const char *what, int w, int h)
+{
+	if (ok) return;
+	fprintf(stderr, "FAIL: %s (%dx%d)\n", what, w, h);
+	++failures;
+}
+
+static int
+random_image(struct image *img)
+{
+	// Runs, small steps and random colours, so that every kind of QOI chunk and
+	// PNG filter gets used
+	int w = 1 + rand() % 300, h = 1 + rand() % 150;
+	if (image_alloc(img, w, h) < 0) return -1;
+	struct rgba px = { 0, 0, 0, 255 };
+	for (int y = 0; y < h; ++y) {
+		for (int x = 0, n; x < w; x += n) {
+			struct rgba *row = image_row(img, x, y, &n);
+			for (int i = 0; i < n; ++i) {
+				switch (rand() % 4) {
+				case 0: break;
+				case 1: {
+					px.r += rand() % 5 - 2;
+					px.g += rand() % 5 - 2;
+					px.b += rand() % 5 - 2;
+				} break;
+				case 2: {
+					px = (struct rgba) { rand(), rand(), rand(), px.a };
+				} break;
+				case 3: {
+					px = (struct rgba) { rand(), rand(), rand(), rand() % 3 ? 255 : rand() };
+				} break;
+				}
+				row[i] = px;
+			}
+		}
+	}
+	return 0;
+}
+
+static int
+same_image(struct image *a, struct image *b)
+{
+	if (a->w != b->w || a->h != b->h) return 0;
+	for (int y = 0; y < a->h; ++y) {
+		for (int x = 0; x < a->w; ++x) {
+			struct rgba p = image_get(a, x, y), q = image_get(b, x, y);
+			if (memcmp(&p, &q, sizeof(p))) return 0;
+		}
+	}
+	return 1;
+}
+
+static int
+paeth(int a, int b, int c)
+{
+	int p = a + b - c, pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+	return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+}
+
+static int
+save_adam7(const char *filepath, struct image *img)
+{
+	// savefn_png never interlaces, so the passes are written here, each row with
+	// the next filter in turn and stored without compression
+	static const int adam7[7][4] = {
+		{ 0, 0, 8, 8 }, { 4, 0, 8, 8 }, { 0, 4, 4, 8 }, { 2, 0, 4, 4 },
+		{ 0, 2, 2, 4 }, { 1, 0, 2, 2 }, { 0, 1, 1, 2 },
+	};
+	int w = img->w, h = img->h;
+	size_t rawlen = 0;
+	for (int p = 0; p < 7; ++p) {
+		int pw = (w - adam7[p][0] + adam7[p][2] - 1) / adam7[p][2];
+		int ph = (h - adam7[p][1] + adam7[p][3] - 1) / adam7[p][3];
+		if (pw > 0 && ph > 0) rawlen += (size_t) ph * (1 + pw * 4);
+	}
+	size_t nblocks = rawlen / 65535 + 1;
+	unsigned char *raw = malloc(rawlen), *z = malloc(2 + rawlen + nblocks * 5 + 4);
+	unsigned char *rows = calloc(2, w * 4 + 4);
+	if (!raw || !z || !rows) {
+		free(raw);
+		free(z);
+		free(rows);
+		return -1;
+	}
+	unsigned char *out = raw;
+	int filter = 0;
+	for (int p = 0; p < 7; ++p) {
+		int pw = (w - adam7[p][0] + adam7[p][2] - 1) / adam7[p][2];
+		int ph = (h - adam7[p][1] + adam7[p][3] - 1) / adam7[p][3];
+		if (pw <= 0 || ph <= 0) continue;
+		// The 4 bytes before each row are zero, for the pixel left of the first
+		unsigned char *prev = rows + 4, *cur = rows + w * 4 + 8;
+		memset(rows, 0, 2 * (w * 4 + 4));
+		for (int y = 0; y < ph; ++y) {
+			for (int i = 0; i < pw; ++i) {
+				struct rgba px = image_get(img, adam7[p][0] + i * adam7[p][2], adam7[p][1] + y * adam7[p][3]);
+				memcpy(cur + i * 4, &px, 4);
+			}
+			*out++ = filter;
+			for (int i = 0; i < pw * 4; ++i) {
+				int a = cur[i - 4], b = prev[i], c = prev[i - 4];
+				int pred = filter == 1 ? a : filter == 2 ? b : filter == 3 ? (a + b) / 2 : filter == 4 ? paeth(a, b, c) : 0;
+				*out++ = cur[i] - pred;
+			}
+			filter = (filter + 1) % 5;
+			unsigned char *t = prev;
+			prev = cur;
+			cur = t;
+		}
+	}
+	unsigned char *q = z;
+	*q++ = 0x78;
+	*q++ = 0x01;
+	for (size_t off = 0; off < rawlen; off += 65535) {
+		size_t n = rawlen - off < 65535 ? rawlen - off : 65535;
+		*q++ = off + n == rawlen;
+		*q++ = n;
+		*q++ = n >> 8;
+		*q++ = ~n;
+		*q++ = ~n >> 8;
+		memcpy(q, raw + off, n);
+		q += n;
+	}
+	uint32_t adler = adler32(1, raw, rawlen);
+	for (int i = 3; i >= 0; --i) *q++ = adler >> (8 * i);
+	FILE *f = fopen(filepath, "wb");
+	unsigned char ihdr[13] = {
+		w >> 24, w >> 16, w >> 8, w,
+		h >> 24, h >> 16, h >> 8, h,
+		8, 6, 0, 0, 1 // 8 bit RGBA, Adam7
+	};
+	// Split across two IDAT chunks, which png_load has to put back together
+	size_t half = (q - z) / 2;
+	int ok = f && fwrite("\x89PNG\r\n\x1a\n", 1, 8, f) == 8 && png_chunk(f, "IHDR", ihdr, 13, NULL) == 0;
+	ok = ok && png_chunk(f, "IDAT", z, half, NULL) == 0 && png_chunk(f, "IDAT", z + half, q - z - half, NULL) == 0;
+	ok = ok && png_chunk(f, "IEND", NULL, 0, NULL) == 0;
+	if (f && fclose(f) != 0) ok = 0;
+	free(raw);
+	free(z);
+	free(rows);
+	return ok ? 0 : -1;
+}
+
+static void
+test_codecs(void)
+{
+	for (int i = 0; i < 40; ++i) {
+		struct image src = {}, png = {}, adam7 = {}, qoi = {};
+		if (random_image(&src) < 0) {
+			check(0, "allocating an image", 0, 0);
+			continue;
+		}
+		int w = src.w, h = src.h;
+		g.pnglevel = rand() % 10;
+		check(savefn_png(path, &src, NULL), "savefn_png", w, h);
+		check(png_load(path, &png, NULL) == 0 && same_image(&src, &png), "savefn_png then png_load", w, h);
+		check(save_adam7(path, &src) == 0, "writing an Adam7 PNG", w, h);
+		check(png_load(path, &adam7, NULL) == 0 && same_image(&src, &adam7), "png_load of Adam7", w, h);
+		check(savefn_qoi(path, &src, NULL), "savefn_qoi", w, h);
+		check(qoi_load(path, &qoi, NULL) == 0 && same_image(&src, &qoi), "savefn_qoi then qoi_load", w, h);
+		image_free(&src);
+		image_free(&png);
+		image_free(&adam7);
+		image_free(&qoi);
+	}
+}
+
+static void
+test_kernels(const char *name, void (*filterfn)(const unsigned char *, const unsigned char *, int, int, unsigned char *, long *), void (*blendfn)(struct rgba *, const struct rgba *, int, enum blendmode))
+{
+	enum { MAX_N = 1200 };
+	static unsigned char rows[2][MAX_N + 4], tmp[2][4 * MAX_N];
+	static struct rgba src[MAX_N], dst[2][MAX_N];
+	char what[64];
+	for (int i = 0; i < 200; ++i) {
+		int n = 1 + rand() % MAX_N;
+		for (int j = 0; j < n; ++j) {
+			rows[0][4 + j] = rand();
+			rows[1][4 + j] = rand() % 4 ? rows[0][4 + j] + rand() % 7 - 3 : rand();
+		}
+		long sums[2][5] = {};
+		png_filter_scalar(rows[0] + 4, rows[1] + 4, 0, n, tmp[0], sums[0]);
+		filterfn(rows[0] + 4, rows[1] + 4, 0, n, tmp[1], sums[1]);
+		snprintf(what, sizeof(what), "png_filter_%s", name);
+		check(!memcmp(tmp[0], tmp[1], 4 * n) && !memcmp(sums[0], sums[1], sizeof(sums[0])), what, n, 1);
+
+		// Transparent and opaque sources take shortcuts in the vectorised versions
+		int alpha = rand() % 3;
+		for (int j = 0; j < n; ++j) {
+			int a = alpha == 0 ? rand() : alpha == 1 ? (rand() % 2) * 255 : rand() % 2 ? 255 : rand();
+			src[j] = (struct rgba) { rand(), rand(), rand(), a };
+			dst[0][j] = dst[1][j] = (struct rgba) { rand(), rand(), rand(), rand() % 2 ? 255 : rand() };
+		}
+		enum blendmode mode = rand() % NBLENDMODES;
+		blend_scalar(dst[0], src, n, mode);
+		blendfn(dst[1], src, n, mode);
+		snprintf(what, sizeof(what), "blend_%s in mode %d", name, mode);
+		check(!memcmp(dst[0], dst[1], n * sizeof(struct rgba)), what, n, 1);
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	unsigned seed = argc > 1 ? strtoul(argv[1], NULL, 10) : (unsigned) time(NULL);
+	printf("seed %u\n", seed);
+	srand(seed);
+	int fd = mkstemp(path);
+	if (fd < 0) {
+		perror("mkstemp");
+		return 1;
+	}
+	close(fd);
+	// No worker threads, the jobs are done right away
+	g.jobssync = 1;
+	g.tilelimit = DEFAULT_TILE_LIMIT;
+	g.pngfilterfn = png_filter_scalar;
+	g.blendfn = blend_scalar;
+	pthread_mutex_init(&g.jobmutex, NULL);
+	test_codecs();
+	test_kernels("scalar", png_filter_scalar, blend_scalar);
+#ifdef SIMD_X86
+	g.pngfilterfn = png_filter_sse2;
+	test_codecs();
+	test_kernels("sse2", png_filter_sse2, blend_sse2);
+	if (__builtin_cpu_supports("avx2")) {
+		g.pngfilterfn = png_filter_avx2;
+		test_codecs();
+		test_kernels("avx2", png_filter_avx2, blend_avx2);
+	}
+#endif
+	remove(path);
+	printf("%s\n", failures ? "FAILED" : "ok");
+	return failures != 0;
+}
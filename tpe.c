@@ -1,25 +1,69 @@
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <notcurses/nckeys.h>
 #include <notcurses/notcurses.h>
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"
+#if defined(__x86_64__) && defined(__GNUC__)
+#define SIMD_X86 // SSE2 is always there, AVX2 is checked for at runtime
+#include <immintrin.h>
+#endif
 
+#define DEFAULT_PNG_LEVEL 6
+#define DEFAULT_TILE_LIMIT (1024 << 20)
+#define DEFAULT_UNDO_LIMIT (256 << 20)
+#define DEFLATE_BLOCK_SYMS 16384
+#define DEFLATE_WINDOW 32768
 #define DIALOG_BG CHANNEL_RGB_INITIALIZER(32, 32, 32)
 #define DIALOG_BG_SEL CHANNEL_RGB_INITIALIZER(64, 64, 64)
+#define FILL_PARALLEL_PIXELS (4 << 20)
+#define FRAME_BUDGET_NS 16000000L
+#define MAX_BRUSH_RADIUS 64
+#define MAX_DAMAGE 16
 #define MAX_FORMAT_NAME_LEN 3
 #define MAX_TOOL_NAME_LEN 7
+#define MAX_WORKERS 1024
+#define MAX_ZOOM_IN 4
+#define MAX_ZOOM_OUT 8
+#define NBLENDMODES (sizeof(BLENDMODES) / sizeof(BLENDMODES[0]))
 #define NFORMATS (sizeof(FORMATS) / sizeof(FORMATS[0]))
+#define NRENDERMODES (sizeof(RENDERMODES) / sizeof(RENDERMODES[0]))
 #define NTOOLS (sizeof(TOOLS) / sizeof(TOOLS[0]))
+#define PNG_BAND_BYTES (256 << 10)
+#define QOI_BUFFER (64 << 10)
+#define TILE_SHIFT 6
+#define TILE_SIZE (1 << TILE_SHIFT)
+#define TILE_MASK (TILE_SIZE - 1)
+#define UNDO_RAW_OPS 8
 
 enum tooltype {
 	TOOL_DRAW,
 	TOOL_PIPETTE,
+	TOOL_FILL,
+	TOOL_LINE,
+	TOOL_RECT,
+	TOOL_ELLIPSE,
+};
+
+enum rendermode {
+	RENDER_CELL,
+	RENDER_HALF,
+	RENDER_QUADRANT,
+	RENDER_SEXTANT,
+	RENDER_PIXEL,
 };
 
 enum format {
@@ -27,6 +71,13 @@ enum format {
 	FORMAT_BMP,
 	FORMAT_TGA,
 	FORMAT_JPG,
+	FORMAT_QOI,
+};
+
+enum blendmode {
+	BLEND_OVER,
+	BLEND_MULTIPLY,
+	BLEND_SCREEN,
 };
 
 // No nasty alignment problems, please
@@ -36,6 +87,155 @@ struct rgba {
 };
 #pragma pack (pop)
 
+struct rect {
+	int x, y, w, h;
+};
+
+// Tiles are shared between images and the undo history, and copied on write
+struct tile {
+	int refs;
+	struct rgba px[TILE_SIZE * TILE_SIZE]; // row major
+};
+
+// An uncompressed 32 bit BMP or TGA file mapped into memory
+struct imagemap {
+	int refs;
+	enum format format;
+	unsigned char *data;
+	size_t size;
+	size_t off; // of the first row in the file
+	int bottomup;
+	int bgra; // otherwise RGBA
+	dev_t dev;
+	ino_t ino;
+};
+
+// Pixels are stored in square tiles, the ones on the right and bottom edge
+// extending past the image
+struct image {
+	int w, h;
+	int tw, th; // size in tiles
+	struct tile **tiles; // row major, NULL for tiles not in memory
+	struct imagemap *map;
+	unsigned char *dirty; // per tile, whether it differs from the mapped file
+	int *slots; // per tile, where in the scratch file a copy of it is, or -1; NULL until a tile is dropped
+	unsigned *used; // per tile, g.tileclock when it was last used; NULL for images not shown in a tab
+	int failed; // 1 once a tile couldn't be read back and was shown blank, 2 once that was reported
+};
+
+// A tile of an image, for picking the ones to drop from memory
+struct tileref {
+	unsigned used;
+	struct image *img;
+	int i;
+};
+
+// Work done off the main thread. fn runs on a worker thread, and then done runs
+// on the main thread to use the results and free the job. When jobs are stopped
+// before a queued job was picked up, only done runs.
+struct job {
+	struct job *next;
+	void (*fn)(struct job *);
+	void (*done)(struct job *);
+	int progress; // percent, set through job_progress
+	struct batch *batch; // set for jobs run by jobs_run, which have no done
+};
+
+struct batch {
+	int pending;
+};
+
+// Decodes the image of an editor whose tab is already open. Decoders that go
+// from top to bottom report the rows they're done with, which the tab shows.
+// Interlaced images are decoded in passes, each one refining the whole image.
+struct loadjob {
+	struct job job;
+	char *filepath;
+	struct editor *ed; // NULL once the tab is closed
+	struct nctab *tab;
+	struct image img; // no tiles if decoding failed
+	int pass, rows; // passes done and rows of the next one decoded so far, set through loadjob_rows
+	pthread_mutex_t lock; // held by the decoder while it changes rows that are already shown
+	int damaged; // the data ended early or didn't match its checksum, so some of the image is blank
+	int failed; // decoding stopped after some rows were shown, so img has tiles until donefn_load frees them
+};
+
+// Writes a snapshot of the image of an editor, which can be edited meanwhile
+struct savejob {
+	struct job job;
+	char *filepath;
+	enum format format;
+	struct editor *ed; // NULL once the tab is closed
+	struct image img; // shares its tiles with the editor, which copies them on write
+	int result; // what savefn returned, -1 before it ran
+	int inplace; // whether only the changed tiles were written into the mapped file
+};
+
+// Compresses one band of a PNG image into raw deflate blocks
+struct pngband {
+	struct job job;
+	struct image *img;
+	int y0, y1;
+	int level;
+	unsigned char *out; // NULL if out of memory
+	size_t len;
+	uint32_t adler; // of the filtered rows
+	size_t rawlen;
+	uint32_t crc; // of the IDAT chunk holding out, not yet inverted
+	struct job *save; // for reporting progress, if any
+	int *bandsdone, nbands;
+};
+
+struct deflate {
+	unsigned char *out;
+	size_t len, cap;
+	uint32_t bits;
+	int nbits;
+	int chain; // how many earlier matches to try at most
+	uint16_t syms[DEFLATE_BLOCK_SYMS][2]; // (literal, 0) or (length, distance)
+	int nsyms;
+	int head[1 << 15]; // last position for each hash, -1 for none
+	int prev[DEFLATE_WINDOW]; // previous position with the same hash
+	uint8_t lencode[259], distcode[512];
+};
+
+// Decodes a zlib stream into a buffer of known size, one deflate block at a time
+struct inflate {
+	const unsigned char *in, *end;
+	uint32_t bits;
+	int nbits;
+	int pad; // zero bytes added to bits after the end of the input
+	unsigned char *out;
+	size_t len, cap;
+	int final; // the last block was decoded
+	// For each possible value of the next 15 bits, the length << 9 | symbol of the
+	// code they start with, 0 if there's none
+	uint16_t lit[1 << 15], dist[1 << 15];
+};
+
+// A flood fill done by the worker threads a tile at a time, for big images
+struct flood {
+	struct image *img;
+	unsigned char (*filled)[TILE_SIZE * TILE_SIZE / 8]; // bitmap per tile
+	struct rgba seed, rgba;
+	int tolerance, diag;
+};
+
+struct floodspans {
+	int (*span)[3]; // x0, x1, y
+	int n, cap;
+};
+
+struct floodtile {
+	struct job job;
+	struct flood *flood;
+	int i;
+	struct floodspans seeds; // pixels of the tile that may have to be filled
+	struct floodspans out; // the same for other tiles, handed to them after the job
+	int x0, y0, x1, y1; // bounds of what was filled
+	int failed; // out of memory
+};
+
 struct g {
 	struct notcurses *nc;
 	struct ncplane *stdp;
@@ -43,17 +243,111 @@ struct g {
 	struct nctabbed *tabbed;
 	struct ncplane *viewplane;
 	int vieww, viewh; // this is the actual width and height of viewplane in cells
+	enum rendermode render;
+	// View pixels are image pixels scaled by the zoom of the editor
+	int blockpw, blockph; // view pixels drawn together as one block...
+	int blockcw, blockch; // ...and the cells such a block takes up
+	int viewpw, viewph; // how many view pixels fit in viewplane
+	struct ncplane *pixplane; // bitmap graphics plane for RENDER_PIXEL
 	char *message;
+	size_t undolimit; // bytes of memory the undo history of one editor may take
+	size_t spilllimit; // bytes of the undo history of one editor that may be spilled to disk
+	int pnglevel;
+	// Computes the Sub, Up, Average and Paeth filtered rows and the filter scores,
+	// with the best instructions the CPU has
+	void (*pngfilterfn)(const unsigned char *cur, const unsigned char *prev, int i, int n, unsigned char *tmp, long *sums);
+	// Composites a row of pixels over another, the same way
+	void (*blendfn)(struct rgba *dst, const struct rgba *src, int n, enum blendmode mode);
+	// Tiles held only by images are dropped from memory, least recently used first,
+	// when there are more of them than fit in tilelimit bytes. Unless the mapped file
+	// still has them, they are kept in slots of the scratch file until needed again.
+	size_t tilelimit;
+	unsigned tileclock; // advanced every frame
+	size_t mipbytes; // taken by the mips of all tabs, out of tilelimit
+	struct tile blanktile; // shown instead of tiles that couldn't be read back
+	FILE *scratch;
+	int *scratchrefs; // per slot
+	int nscratch, scratchcap;
+	int *scratchfree; // slots with no references
+	int nscratchfree;
+	// What is currently drawn on viewplane, so that only the changes are redrawn
+	struct editor *shown;
+	int shownzoom;
+	int shownviewx, shownviewy; // in view pixels
+	int showncurx, showncury;
+	// Worker threads, which wake the main thread through wakefd when a job is done
+	pthread_t *workers;
+	int nworkers;
+	pthread_mutex_t jobmutex;
+	pthread_cond_t jobcond;
+	struct job *jobs, *jobstail; // queued
+	struct job *donejobs; // most recently done first
+	int jobsstopped;
+	int jobssync; // there are no worker threads, so jobs are done right away
+	pthread_cond_t batchcond;
+	int wakefd[2];
+	int loading; // tabs whose image is still being decoded
 };
 
-struct editor {
-	char *filepath;
+struct mipmap {
 	int w, h;
 	struct rgba *data;
+};
+
+// A tile of an older undo operation, compressed in memory or spilled to disk
+struct packedtile {
+	unsigned char *data;
+	int len;
+	long off; // offset into the spill file, -1 if still in memory
+};
+
+// An operation in the undo history. Undoing or redoing it swaps its tiles
+// with the ones in the image.
+struct undo {
+	struct undo *prev, *next;
+	int n, cap;
+	int *idx;
+	struct tile **tiles; // NULL for the ones that are packed
+	struct packedtile *packed; // NULL if nothing is packed
+	int spilled;
+};
+
+struct editor {
+	char *filepath;
+	struct image img; // only the size is known while load is set
+	struct loadjob *load;
+	int loadpass, loadrows; // while load is set, how much of its image is shown
+	struct savejob *save;
 	enum tooltype tool;
 	int viewx, viewy;
 	int curx, cury; // not relative to view{x,y}
+	int zoom; // > 0 shrinks the view 2^zoom times, < 0 magnifies it 2^-zoom times
+	int zw, zh; // size of the image in view pixels
+	struct mipmap mips[MAX_ZOOM_OUT]; // mips[i] is the image shrunk 2^(i+1) times, built when needed
+	struct undo *history; // oldest operation
+	struct undo *undo; // last operation applied, the ones after it can be redone
+	struct undo *op; // operation being recorded
+	size_t undobytes; // in memory
+	FILE *spill;
+	long spillend, spilllive; // where to append to the spill file, and how much of it is still used
+	unsigned *tilestamp; // per tile, the opstamp of the last operation that saved it
+	unsigned opstamp;
 	struct rgba pricol, seccol;
+	int filltolerance; // how much each channel may differ from the pixel a fill starts at
+	int fill8; // whether fills spread diagonally too
+	int filled; // whether rectangles and ellipses are drawn filled or as outlines
+	int anchored; // the first end or corner of a shape was chosen, at anchor{x,y}
+	int anchorx, anchory;
+	int mousedown; // a mouse button is held, so its events are drags
+	int strokex, strokey; // where the last event of a drag was
+	unsigned char **strokecov; // per tile, how much the brush has covered each pixel during the drag
+	int brushradius;
+	int brushround; // or square
+	int brushhardness; // percentage of the radius drawn at full strength
+	unsigned char *brushmask; // coverage of the (2 * brushradius + 1)^2 pixels, NULL after the brush changed
+	enum blendmode blend; // how the brush colour mixes with the pixels it is drawn over
+	struct rect damage[MAX_DAMAGE]; // image regions that need to be redrawn
+	int ndamage;
 };
 
 struct tool {
@@ -61,54 +355,824 @@ struct tool {
 	void (*fn)(struct editor *, struct ncinput *);
 };
 
+struct rendermodedata {
+	const char *name;
+	int blockpw, blockph, blockcw, blockch; // zero pixel sizes are taken from the cell size
+	// Draws the block whose top left view pixel is (x, y) at cell (cx, cy) of viewplane,
+	// given its pixels in rows stride apart
+	void (*drawfn)(struct editor *ed, const struct rgba *px, int stride, int x, int y, int cx, int cy);
+};
+
 struct formatdata {
 	const char *name;
-	int (*savefn)(char const *, int, int, int, const void *);
+	int (*savefn)(const char *, struct image *, struct job *);
 };
 
+static uint32_t adler32(uint32_t adler, const unsigned char *p, size_t n);
+static uint32_t adler32_combine(uint32_t a, uint32_t b, size_t blen);
+static void blend_scalar(struct rgba *dst, const struct rgba *src, int n, enum blendmode mode);
+#ifdef SIMD_X86
+static void blend_sse2(struct rgba *dst, const struct rgba *src, int n, enum blendmode mode);
+static void blend_avx2(struct rgba *dst, const struct rgba *src, int n, enum blendmode mode);
+#endif
+static unsigned block_split(struct editor *ed, const struct rgba *pixels, int stride, int x, int y, int pw, int ph);
+static unsigned char *brush_mask(struct editor *ed);
+static int brush_stamp(struct editor *ed, const unsigned char *mask, int cx, int cy, struct rgba rgba);
 static void cleanup();
+static uint32_t crc32_update(uint32_t crc, const unsigned char *p, size_t n);
+static void damage(struct editor *ed, int x, int y, int w, int h);
+static int deflate_band(struct deflate *d, const unsigned char *data, int n);
+static int deflate_block(struct deflate *d);
+static void deflate_codes(const uint8_t *len, int n, uint16_t *code);
+static void deflate_huffman(const int *freq, int n, int limit, uint8_t *len);
+static void deflate_init(struct deflate *d, int level);
+static int deflate_put(struct deflate *d, uint32_t v, int n);
 static int dialog_save(struct editor *ed);
+static struct rgba *edit_row(struct editor *ed, int x, int y, int *n);
+static int edit_span(struct editor *ed, int x0, int x1, int y, struct rgba rgba);
+static int edit_tile(struct editor *ed, int i);
 static int dialog_tool(struct editor *ed);
-static void init();
-static void main_loop();
+static void flood_fill(struct editor *ed, int x, int y, struct rgba rgba);
+static void flood_fill_tiles(struct editor *ed, int x, int y, struct rgba rgba);
+static int flood_match(struct editor *ed, const unsigned char *filled, struct rgba seed, int x, int y);
+static int floodspans_add(struct floodspans *s, int x0, int x1, int y);
+static int floodtile_match(struct flood *flood, int x, int y);
+static int floodtile_pending(struct floodtile *ft);
+static int floodtile_push(struct floodtile *ft, int x0, int x1, int y);
+static void free_editor(struct editor *ed);
+static int handle_input(struct ncinput *ni);
+static void image_changed(struct editor *ed, int x, int y, int w, int h);
+static void image_dirty(struct image *img, int i);
+static struct rgba *image_flatten(struct image *img, struct job *job);
+static void image_free(struct image *img);
+static int image_alloc(struct image *img, int w, int h);
+static int image_alloc_row(struct image *img, int ty);
+static int image_from_rgba(struct image *img, const struct rgba *data, int w, int h);
+static struct rgba image_get(struct image *img, int x, int y);
+static int image_init(struct image *img, int w, int h);
+static struct rgba *image_row(struct image *img, int x, int y, int *n);
+static void image_snapshot(struct image *dst, struct image *src);
+static struct tile *image_tile(struct image *img, int i);
+static int imagemap_open(const char *filepath, struct image *img);
+static const unsigned char *imagemap_row(struct imagemap *m, struct image *img, int y);
+static int imagemap_save(const char *filepath, enum format format, struct image *img, struct job *job);
+static void imagemap_unref(struct imagemap *m);
+static int inflate_block(struct inflate *s);
+static int inflate_get(struct inflate *s, int n);
+static int inflate_symbol(struct inflate *s, const uint16_t *table);
+static int inflate_table(uint16_t *table, const uint8_t *len, int n);
+static int init();
+static int input_pending(struct ncinput *ni);
+static void job_prioritize(struct job *job);
+static void job_progress(struct job *job, int progress);
+static void job_submit(struct job *job);
+static void jobs_reap();
+static void jobs_run(struct job **jobs, int n);
+static void jobs_start(int n);
+static void jobs_stop();
+static void jobs_wake();
+static void loadjob_rows(struct loadjob *lj, int pass, int rows);
+static int main_loop();
 static void message(const char *msg);
+static int mip_build(struct editor *ed, int level);
+static void mip_fill(struct editor *ed, int i, int x0, int y0, int x1, int y1);
+static void mip_update(struct editor *ed, int x, int y, int w, int h);
 static int open_file(const char *filepath);
+static long option_num(const char *arg, long min, long max);
+static int png_chunk(FILE *f, const char *type, const unsigned char *data, size_t len, const uint32_t *crc);
+static void png_filter(const unsigned char *cur, const unsigned char *prev, int n, int level, unsigned char *out, unsigned char *tmp);
+static int png_load(const char *filepath, struct image *img, struct loadjob *lj);
+static int png_paeth(int a, int b, int c);
+static int png_unfilter(unsigned char *row, const unsigned char *prev, int n, int bpp, int type);
+static void png_filter_scalar(const unsigned char *cur, const unsigned char *prev, int i, int n, unsigned char *tmp, long *sums);
+#ifdef SIMD_X86
+static void png_filter_sse2(const unsigned char *cur, const unsigned char *prev, int i, int n, unsigned char *tmp, long *sums);
+static void png_filter_avx2(const unsigned char *cur, const unsigned char *prev, int i, int n, unsigned char *tmp, long *sums);
+#endif
+static int qoi_info(const char *filepath, int *w, int *h);
+static int qoi_load(const char *filepath, struct image *img, struct loadjob *lj);
+static unsigned char *read_file(const char *filepath, long *len);
+static int redo(struct editor *ed);
+static struct rect rect_to_view(struct editor *ed, struct rect r);
+static struct rect rect_union(struct rect a, struct rect b);
+static int rgb_dist(struct rgba p, struct rgba q);
+static int scratch_put(struct tile *t);
+static void scratch_unref(int slot);
+static int set_rendermode(enum rendermode mode);
+static int set_zoom(struct editor *ed, int zoom);
+static void stroke_end(struct editor *ed);
+static int shape_ellipse(struct editor *ed, int x0, int y0, int x1, int y1, struct rgba rgba);
+static int shape_line(struct editor *ed, int x0, int y0, int x1, int y1, struct rgba rgba);
+static int shape_rect(struct editor *ed, int x0, int y0, int x1, int y1, struct rgba rgba);
 static void tab_callback(struct nctab* tab, struct ncplane* ncp, void* curry);
+static struct tile *tile_dup(struct tile *t);
+static void tile_unref(struct tile *t);
+static int tileref_cmp(const void *a, const void *b);
+static void tiles_evict();
+static void tiles_prefetch(struct editor *ed);
+static int to_image(struct editor *ed, int v);
+static int to_view(struct editor *ed, int v);
+static int undo(struct editor *ed);
+static void undo_commit(struct editor *ed);
+static void undo_free(struct editor *ed, struct undo *op);
+static void undo_pack(struct editor *ed, struct undo *op);
+static int undo_spill(struct editor *ed, struct undo *op);
+static int undo_swap(struct editor *ed, struct undo *op);
+static void undo_trim(struct editor *ed, struct undo *keep);
+static int undo_unpack(struct editor *ed, struct undo *op);
+static void view_blit(struct editor *ed);
+static int view_cursor_at(struct editor *ed, int x, int y);
+static void view_draw(struct editor *ed, int x, int y, int w, int h);
+static void view_row(struct editor *ed, int x, int y, int n, struct rgba *out);
+static void view_scroll(struct editor *ed, int dx, int dy);
+static void *worker_main(void *arg);
 static void toolfn_draw(struct editor *ed, struct ncinput *ni);
 static void toolfn_pipette(struct editor *ed, struct ncinput *ni);
-static int savefn_jpg(char const *filepath, int w, int h, int comp, const void *data);
-static int savefn_png(char const *filepath, int w, int h, int comp, const void *data);
+static void toolfn_fill(struct editor *ed, struct ncinput *ni);
+static void toolfn_shape(struct editor *ed, struct ncinput *ni);
+static void jobfn_floodtile(struct job *job);
+static void jobfn_load(struct job *job);
+static void donefn_load(struct job *job);
+static void jobfn_pngband(struct job *job);
+static void jobfn_save(struct job *job);
+static void donefn_save(struct job *job);
+static void drawfn_cell(struct editor *ed, const struct rgba *px, int stride, int x, int y, int cx, int cy);
+static void drawfn_half(struct editor *ed, const struct rgba *px, int stride, int x, int y, int cx, int cy);
+static void drawfn_quadrant(struct editor *ed, const struct rgba *px, int stride, int x, int y, int cx, int cy);
+static void drawfn_sextant(struct editor *ed, const struct rgba *px, int stride, int x, int y, int cx, int cy);
+static int savefn_bmp(const char *filepath, struct image *img, struct job *job);
+static int savefn_jpg(const char *filepath, struct image *img, struct job *job);
+static int savefn_png(const char *filepath, struct image *img, struct job *job);
+static int savefn_qoi(const char *filepath, struct image *img, struct job *job);
+static int savefn_tga(const char *filepath, struct image *img, struct job *job);
 
 struct tool TOOLS[] = {
 	[TOOL_DRAW] = { "draw", toolfn_draw },
 	[TOOL_PIPETTE] = { "pipette", toolfn_pipette },
+	[TOOL_FILL] = { "fill", toolfn_fill },
+	[TOOL_LINE] = { "line", toolfn_shape },
+	[TOOL_RECT] = { "rect", toolfn_shape },
+	[TOOL_ELLIPSE] = { "ellipse", toolfn_shape },
+};
+
+struct rendermodedata RENDERMODES[] = {
+	[RENDER_CELL] = { "cell", 1, 1, 2, 1, drawfn_cell },
+	[RENDER_HALF] = { "half", 1, 2, 1, 1, drawfn_half },
+	[RENDER_QUADRANT] = { "quadrant", 2, 2, 1, 1, drawfn_quadrant },
+	[RENDER_SEXTANT] = { "sextant", 2, 3, 1, 1, drawfn_sextant },
+	[RENDER_PIXEL] = { "pixel", 0, 0, 1, 1, NULL },
+};
+
+const char *BLENDMODES[] = {
+	[BLEND_OVER] = "over",
+	[BLEND_MULTIPLY] = "multiply",
+	[BLEND_SCREEN] = "screen",
 };
 
 struct formatdata FORMATS[] = {
 	[FORMAT_PNG] = { "PNG", savefn_png },
-	[FORMAT_BMP] = { "BMP", stbi_write_bmp },
-	[FORMAT_TGA] = { "TGA", stbi_write_tga },
+	[FORMAT_BMP] = { "BMP", savefn_bmp },
+	[FORMAT_TGA] = { "TGA", savefn_tga },
 	[FORMAT_JPG] = { "JPG", savefn_jpg },
+	[FORMAT_QOI] = { "QOI", savefn_qoi },
+};
+
+// The extra bits and base values of deflate's length and distance codes, and
+// the order code length code lengths are sent in
+const uint8_t LENEXTRA[29] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+const uint16_t LENBASE[29] = {
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+	35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+const uint8_t DISTEXTRA[30] = {
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+const uint16_t DISTBASE[30] = {
+	1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+	257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
 };
+const uint8_t CLORDER[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
 
 struct g g;
 
+uint32_t
+adler32(uint32_t adler, const unsigned char *p, size_t n)
+{
+	uint32_t a = adler & 0xFFFF, b = adler >> 16;
+	while (n) {
+		// 5552 bytes is as much as can be summed up before reducing
+		size_t k = n < 5552 ? n : 5552;
+		n -= k;
+		while (k--) {
+			a += *p++;
+			b += a;
+		}
+		a %= 65521;
+		b %= 65521;
+	}
+	return a | b << 16;
+}
+
+uint32_t
+adler32_combine(uint32_t a, uint32_t b, size_t blen)
+{
+	// The checksum of two pieces of data from the checksums of each
+	unsigned long rem = blen % 65521;
+	unsigned long a1 = a & 0xFFFF, a2 = a >> 16;
+	unsigned long s1 = (a1 + (b & 0xFFFF) + 65521 - 1) % 65521;
+	unsigned long s2 = (rem * a1 % 65521 + a2 + (b >> 16) + 65521 - rem) % 65521;
+	return s1 | s2 << 16;
+}
+
+void
+blend_scalar(struct rgba *dst, const struct rgba *src, int n, enum blendmode mode)
+{
+	// Porter-Duff over with straight alpha, of the source colour mixed with the
+	// destination as the mode says where the destination is opaque. The vectorised
+	// versions do the same float operations in the same order, so they all agree
+	// to the bit. There are no branches in the loop so that compilers can vectorise
+	// it too: the mode picks terms by multiplying them with 0 or 1, which is exact,
+	// and pixels under a transparent source are kept with a mask.
+	float mix = mode != BLEND_OVER, mul = mode == BLEND_MULTIPLY, scr = mode == BLEND_SCREEN;
+	for (int i = 0; i < n; ++i) {
+		int sp[4] = { src[i].r, src[i].g, src[i].b, src[i].a };
+		int dp[4] = { dst[i].r, dst[i].g, dst[i].b, dst[i].a }, out[4];
+		float sa = sp[3], da = dp[3], dw = da * (255 - sa), t = sa * 255 + dw;
+		// t is only 0 where the source is transparent, and those pixels are kept
+		float inv = 1 / (t + (sa == 0)), ws = sa * 255 * inv, wd = dw * inv;
+		for (int c = 0; c < 3; ++c) {
+			float sc = sp[c], dc = dp[c];
+			// 255 times the multiplied or screened colour, exact
+			float b = mul * (sc * dc) + scr * ((sc + dc) * 255 - sc * dc);
+			float m = (1 - mix) * sc + mix * (((255 - da) * sc * 255 + da * b) * (1.0f / 65025));
+			out[c] = (int) (m * ws + dc * wd + 0.5f);
+		}
+		out[3] = (int) (t * (1.0f / 255) + 0.5f);
+		int keep = -(sp[3] == 0);
+		for (int c = 0; c < 4; ++c) out[c] = (out[c] & ~keep) | (dp[c] & keep);
+		dst[i] = (struct rgba) { out[0], out[1], out[2], out[3] };
+	}
+}
+
+#ifdef SIMD_X86
+void
+blend_sse2(struct rgba *dst, const struct rgba *src, int n, enum blendmode mode)
+{
+	// Four pixels at a time, with each channel in a vector of its own
+	__m128i z = _mm_setzero_si128(), low = _mm_set1_epi32(0xFF);
+	__m128 one = _mm_set1_ps(1), c255 = _mm_set1_ps(255), half = _mm_set1_ps(0.5f);
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m128i s = _mm_loadu_si128((const __m128i *) (src + i));
+		// Transparent source pixels leave the destination as it is, and opaque ones
+		// drawn over it replace it, which is what the arithmetic would give too
+		__m128i sa8 = _mm_srli_epi32(s, 24), keep = _mm_cmpeq_epi32(sa8, z);
+		if (_mm_movemask_epi8(keep) == 0xFFFF) continue;
+		if (mode == BLEND_OVER && _mm_movemask_epi8(_mm_cmpeq_epi32(sa8, low)) == 0xFFFF) {
+			_mm_storeu_si128((__m128i *) (dst + i), s);
+			continue;
+		}
+		__m128i d = _mm_loadu_si128((const __m128i *) (dst + i));
+		__m128 sc[4], dc[4];
+		for (int c = 0; c < 4; ++c) {
+			sc[c] = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(s, 8 * c), low));
+			dc[c] = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(d, 8 * c), low));
+		}
+		__m128 sa = sc[3], da = dc[3], dw = _mm_mul_ps(da, _mm_sub_ps(c255, sa));
+		__m128 t = _mm_add_ps(_mm_mul_ps(sa, c255), dw);
+		__m128 inv = _mm_div_ps(one, t), ws = _mm_mul_ps(_mm_mul_ps(sa, c255), inv), wd = _mm_mul_ps(dw, inv);
+		__m128i out = _mm_slli_epi32(_mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(t, _mm_set1_ps(1.0f / 255)), half)), 24);
+		for (int c = 0; c < 3; ++c) {
+			__m128 m = sc[c];
+			if (mode != BLEND_OVER) {
+				__m128 sd = _mm_mul_ps(sc[c], dc[c]);
+				__m128 b = mode == BLEND_MULTIPLY ? sd : _mm_sub_ps(_mm_mul_ps(_mm_add_ps(sc[c], dc[c]), c255), sd);
+				m = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(_mm_sub_ps(c255, da), sc[c]), c255), _mm_mul_ps(da, b));
+				m = _mm_mul_ps(m, _mm_set1_ps(1.0f / 65025));
+			}
+			__m128 v = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m, ws), _mm_mul_ps(dc[c], wd)), half);
+			out = _mm_or_si128(out, _mm_slli_epi32(_mm_cvttps_epi32(v), 8 * c));
+		}
+		out = _mm_or_si128(_mm_and_si128(keep, d), _mm_andnot_si128(keep, out));
+		_mm_storeu_si128((__m128i *) (dst + i), out);
+	}
+	blend_scalar(dst + i, src + i, n - i, mode);
+}
+
+__attribute__((target("avx2"))) void
+blend_avx2(struct rgba *dst, const struct rgba *src, int n, enum blendmode mode)
+{
+	// Same as blend_sse2, eight pixels at a time
+	__m256i z = _mm256_setzero_si256(), low = _mm256_set1_epi32(0xFF);
+	__m256 one = _mm256_set1_ps(1), c255 = _mm256_set1_ps(255), half = _mm256_set1_ps(0.5f);
+	int i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256i s = _mm256_loadu_si256((const __m256i *) (src + i));
+		__m256i sa8 = _mm256_srli_epi32(s, 24), keep = _mm256_cmpeq_epi32(sa8, z);
+		if (_mm256_movemask_epi8(keep) == -1) continue;
+		if (mode == BLEND_OVER && _mm256_movemask_epi8(_mm256_cmpeq_epi32(sa8, low)) == -1) {
+			_mm256_storeu_si256((__m256i *) (dst + i), s);
+			continue;
+		}
+		__m256i d = _mm256_loadu_si256((const __m256i *) (dst + i));
+		__m256 sc[4], dc[4];
+		for (int c = 0; c < 4; ++c) {
+			sc[c] = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(s, 8 * c), low));
+			dc[c] = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(d, 8 * c), low));
+		}
+		__m256 sa = sc[3], da = dc[3], dw = _mm256_mul_ps(da, _mm256_sub_ps(c255, sa));
+		__m256 t = _mm256_add_ps(_mm256_mul_ps(sa, c255), dw);
+		__m256 inv = _mm256_div_ps(one, t), ws = _mm256_mul_ps(_mm256_mul_ps(sa, c255), inv), wd = _mm256_mul_ps(dw, inv);
+		__m256i out = _mm256_slli_epi32(_mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(t, _mm256_set1_ps(1.0f / 255)), half)), 24);
+		for (int c = 0; c < 3; ++c) {
+			__m256 m = sc[c];
+			if (mode != BLEND_OVER) {
+				__m256 sd = _mm256_mul_ps(sc[c], dc[c]);
+				__m256 b = mode == BLEND_MULTIPLY ? sd : _mm256_sub_ps(_mm256_mul_ps(_mm256_add_ps(sc[c], dc[c]), c255), sd);
+				m = _mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(_mm256_sub_ps(c255, da), sc[c]), c255), _mm256_mul_ps(da, b));
+				m = _mm256_mul_ps(m, _mm256_set1_ps(1.0f / 65025));
+			}
+			__m256 v = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m, ws), _mm256_mul_ps(dc[c], wd)), half);
+			out = _mm256_or_si256(out, _mm256_slli_epi32(_mm256_cvttps_epi32(v), 8 * c));
+		}
+		out = _mm256_blendv_epi8(out, d, keep);
+		_mm256_storeu_si256((__m256i *) (dst + i), out);
+	}
+	blend_sse2(dst + i, src + i, n - i, mode);
+}
+#endif
+
+unsigned
+block_split(struct editor *ed, const struct rgba *pixels, int stride, int x, int y, int pw, int ph)
+{
+	// Approximates a block of up to 6 view pixels with a foreground and a background
+	// colour set on viewplane. Bit i of the result is set if pixel i (in row major
+	// order) belongs to the foreground.
+	struct rgba px[6];
+	int n = pw * ph, inside = 1;
+	for (int i = 0; i < n; ++i) {
+		int ix = x + i % pw, iy = y + i / pw;
+		if (ix >= ed->zw || iy >= ed->zh) {
+			inside = 0;
+			continue;
+		}
+		px[i] = pixels[i % pw + i / pw * stride];
+		if (view_cursor_at(ed, ix, iy)) {
+			px[i].r = 255 - px[i].r;
+			px[i].g = 255 - px[i].g;
+			px[i].b = 255 - px[i].b;
+		}
+	}
+	unsigned mask = 0;
+	if (!inside) {
+		// Past the edge of the image there is only the default background
+		for (int i = 0; i < n; ++i) {
+			if (x + i % pw < ed->zw && y + i / pw < ed->zh) mask |= 1u << i;
+		}
+	} else {
+		// Split the pixels around the two that differ the most
+		int a = 0, b = 1, best = -1;
+		for (int i = 0; i < n; ++i) {
+			for (int j = i + 1; j < n; ++j) {
+				int d = rgb_dist(px[i], px[j]);
+				if (d > best) {
+					best = d;
+					a = i;
+					b = j;
+				}
+			}
+		}
+		for (int i = 0; i < n; ++i) {
+			if (rgb_dist(px[i], px[b]) < rgb_dist(px[i], px[a])) mask |= 1u << i;
+		}
+	}
+	int sum[2][4] = {};
+	for (int i = 0; i < n; ++i) {
+		if (!inside && !(mask & 1u << i)) continue;
+		int *s = sum[!!(mask & 1u << i)];
+		s[0] += px[i].r;
+		s[1] += px[i].g;
+		s[2] += px[i].b;
+		++s[3];
+	}
+	if (sum[1][3]) {
+		ncplane_set_fg_rgb8(g.viewplane, sum[1][0] / sum[1][3], sum[1][1] / sum[1][3], sum[1][2] / sum[1][3]);
+	}
+	if (sum[0][3]) {
+		ncplane_set_bg_rgb8(g.viewplane, sum[0][0] / sum[0][3], sum[0][1] / sum[0][3], sum[0][2] / sum[0][3]);
+	} else {
+		ncplane_set_bg_default(g.viewplane);
+	}
+	return mask;
+}
+
+unsigned char *
+brush_mask(struct editor *ed)
+{
+	// Full strength up to the hardness, fading out linearly from there to the edge
+	if (ed->brushmask) return ed->brushmask;
+	int r = ed->brushradius, s = 2 * r + 1;
+	unsigned char *mask = malloc(s * s);
+	if (!mask) return NULL;
+	float outer = r + 0.5f, inner = outer * ed->brushhardness / 100;
+	for (int y = -r; y <= r; ++y) {
+		for (int x = -r; x <= r; ++x) {
+			float d = ed->brushround ? sqrtf(x * x + y * y) : abs(x) > abs(y) ? abs(x) : abs(y);
+			float c = d <= inner ? 1 : d >= outer ? 0 : (outer - d) / (outer - inner);
+			mask[(x + r) + (y + r) * s] = c * 255 + 0.5f;
+		}
+	}
+	return ed->brushmask = mask;
+}
+
+int
+brush_stamp(struct editor *ed, const unsigned char *mask, int cx, int cy, struct rgba rgba)
+{
+	// Blends rgba over the pixels around (cx, cy) as much as the mask covers them.
+	// During a drag a pixel only gets more of the colour where it is covered more
+	// than before, by as much as makes up the difference, so that the overlapping
+	// stamps of a stroke don't build up.
+	int r = ed->brushradius, s = 2 * r + 1;
+	for (int my = 0; my < s; ++my) {
+		int y = cy - r + my;
+		if (y < 0 || y >= ed->img.h) continue;
+		const unsigned char *m = mask + my * s;
+		int x0 = cx - r, x1 = cx + r;
+		while (x0 <= x1 && !m[x0 - cx + r]) ++x0;
+		while (x1 >= x0 && !m[x1 - cx + r]) --x1;
+		if (x0 < 0) x0 = 0;
+		if (x1 >= ed->img.w) x1 = ed->img.w - 1;
+		for (int x = x0, n; x <= x1; x += n) {
+			struct rgba *row = edit_row(ed, x, y, &n), src[TILE_SIZE];
+			if (!row) return -1;
+			if (n > x1 - x + 1) n = x1 - x + 1;
+			unsigned char *cov = NULL;
+			if (ed->strokecov) {
+				int i = (x >> TILE_SHIFT) + (y >> TILE_SHIFT) * ed->img.tw;
+				if (!ed->strokecov[i]) ed->strokecov[i] = calloc(TILE_SIZE * TILE_SIZE, 1);
+				if (ed->strokecov[i]) cov = ed->strokecov[i] + (x & TILE_MASK) + ((y & TILE_MASK) << TILE_SHIFT);
+			}
+			for (int j = 0; j < n; ++j) {
+				int c = m[x + j - cx + r], a = (rgba.a * c + 127) / 255;
+				if (cov) {
+					int before = (rgba.a * cov[j] + 127) / 255;
+					if (c <= cov[j] || before == 255) {
+						a = 0;
+					} else {
+						a = ((a - before) * 255 + (255 - before) / 2) / (255 - before);
+						cov[j] = c;
+					}
+				}
+				src[j] = (struct rgba) { rgba.r, rgba.g, rgba.b, a };
+			}
+			g.blendfn(row, src, n, ed->blend);
+		}
+	}
+	return 0;
+}
+
 void
 cleanup()
 {
+	// Finishing the jobs may still add tabs, so stop them first
+	jobs_stop();
 	struct nctab *tab;
 	while ((tab = nctabbed_selected(g.tabbed))) {
-		struct editor *ed = nctab_userptr(tab);
-		stbi_image_free(ed->data);
-		free(ed->filepath);
-		free(ed);
+		free_editor(nctab_userptr(tab));
 		nctabbed_del(g.tabbed, tab);
 	}
 	nctabbed_destroy(g.tabbed);
+	close(g.wakefd[0]);
+	close(g.wakefd[1]);
+	if (g.scratch) fclose(g.scratch);
+	free(g.scratchrefs);
+	free(g.scratchfree);
 	free(g.message);
 	notcurses_stop(g.nc);
 }
 
+uint32_t
+crc32_update(uint32_t crc, const unsigned char *p, size_t n)
+{
+	// A nibble at a time, which needs only a tiny table
+	static const uint32_t table[16] = {
+		0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+		0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C,
+	};
+	while (n--) {
+		crc ^= *p++;
+		crc = crc >> 4 ^ table[crc & 15];
+		crc = crc >> 4 ^ table[crc & 15];
+	}
+	return crc;
+}
+
+void
+damage(struct editor *ed, int x, int y, int w, int h)
+{
+	if (x < 0) { w += x; x = 0; }
+	if (y < 0) { h += y; y = 0; }
+	if (w > ed->img.w - x) w = ed->img.w - x;
+	if (h > ed->img.h - y) h = ed->img.h - y;
+	if (w <= 0 || h <= 0) return;
+	struct rect r = { x, y, w, h };
+	// Merge with any rect it touches, repeating since the union can grow into others
+	for (int i = 0; i < ed->ndamage; ++i) {
+		struct rect *d = &ed->damage[i];
+		if (r.x > d->x + d->w || d->x > r.x + r.w || r.y > d->y + d->h || d->y > r.y + r.h) continue;
+		r = rect_union(r, *d);
+		ed->damage[i] = ed->damage[--ed->ndamage];
+		i = -1;
+	}
+	if (ed->ndamage == MAX_DAMAGE) {
+		// Out of slots, collapse everything into one bounding box
+		for (int i = 0; i < ed->ndamage; ++i) {
+			r = rect_union(r, ed->damage[i]);
+		}
+		ed->ndamage = 0;
+	}
+	ed->damage[ed->ndamage++] = r;
+}
+
+int
+deflate_band(struct deflate *d, const unsigned char *data, int n)
+{
+	// Compresses data into blocks that don't end the stream, followed by an empty
+	// stored block so that the output ends on a byte boundary
+	if (d->chain == 0) {
+		for (int i = 0; i < n || i == 0; i += 65535) {
+			int len = n - i < 65535 ? n - i : 65535;
+			if (deflate_put(d, 0, 3) < 0 || deflate_put(d, 0, -1) < 0) return -1;
+			if (deflate_put(d, len, 16) < 0 || deflate_put(d, len ^ 0xFFFF, 16) < 0) return -1;
+			for (int j = 0; j < len; ++j) {
+				if (deflate_put(d, data[i + j], 8) < 0) return -1;
+			}
+		}
+		return 0;
+	}
+	for (int i = 0; i < n;) {
+		int best = 0, bestdist = 0;
+		if (i + 3 <= n) {
+			int h = (data[i] << 10 ^ data[i + 1] << 5 ^ data[i + 2]) & 0x7FFF;
+			int maxlen = n - i < 258 ? n - i : 258;
+			int chain = d->chain;
+			for (int j = d->head[h]; j >= 0 && i - j <= DEFLATE_WINDOW && chain--; j = d->prev[j % DEFLATE_WINDOW]) {
+				if (data[j + best] != data[i + best]) continue;
+				int len = 0;
+				while (len < maxlen && data[j + len] == data[i + len]) ++len;
+				if (len > best) {
+					best = len;
+					bestdist = i - j;
+					if (len == maxlen) break;
+				}
+			}
+		}
+		int step = best >= 3 ? best : 1;
+		if (best >= 3) {
+			d->syms[d->nsyms][0] = best;
+			d->syms[d->nsyms][1] = bestdist;
+		} else {
+			d->syms[d->nsyms][0] = data[i];
+			d->syms[d->nsyms][1] = 0;
+		}
+		if (++d->nsyms == DEFLATE_BLOCK_SYMS && deflate_block(d) < 0) return -1;
+		for (; step--; ++i) {
+			if (i + 3 > n) continue;
+			int h = (data[i] << 10 ^ data[i + 1] << 5 ^ data[i + 2]) & 0x7FFF;
+			d->prev[i % DEFLATE_WINDOW] = d->head[h];
+			d->head[h] = i;
+		}
+	}
+	if (d->nsyms && deflate_block(d) < 0) return -1;
+	if (deflate_put(d, 0, 3) < 0 || deflate_put(d, 0, -1) < 0) return -1;
+	return deflate_put(d, 0xFFFF0000, 32);
+}
+
+int
+deflate_block(struct deflate *d)
+{
+	int litfreq[288] = {}, distfreq[30] = {};
+	for (int i = 0; i < d->nsyms; ++i) {
+		int len = d->syms[i][0], dist = d->syms[i][1];
+		if (dist) {
+			++litfreq[257 + d->lencode[len]];
+			++distfreq[d->distcode[dist <= 256 ? dist - 1 : 256 + ((dist - 1) >> 7)]];
+		} else {
+			++litfreq[len];
+		}
+	}
+	litfreq[256] = 1;
+	
+	// Dynamic codes, unless the fixed ones come out smaller
+	uint8_t litlen[288], distlen[30], lens[286 + 30], cllen[19];
+	deflate_huffman(litfreq, 286, 15, litlen);
+	deflate_huffman(distfreq, 30, 15, distlen);
+	litlen[286] = litlen[287] = 0;
+	int nlit = 286, ndist = 30;
+	while (nlit > 257 && !litlen[nlit - 1]) --nlit;
+	while (ndist > 1 && !distlen[ndist - 1]) --ndist;
+	if (!distlen[0] && ndist == 1) distlen[0] = 1; // some decoders don't like having no distance codes
+	memcpy(lens, litlen, nlit);
+	memcpy(lens + nlit, distlen, ndist);
+	// The code lengths are themselves run length encoded and Huffman coded
+	uint8_t cl[286 + 30], clextra[286 + 30];
+	int ncl = 0, clfreq[19] = {};
+	for (int i = 0; i < nlit + ndist;) {
+		int run = 1;
+		while (i + run < nlit + ndist && lens[i + run] == lens[i]) ++run;
+		if (lens[i] == 0 && run >= 3) {
+			if (run > 138) run = 138;
+			cl[ncl] = run >= 11 ? 18 : 17;
+			clextra[ncl++] = run >= 11 ? run - 11 : run - 3;
+		} else if (lens[i] != 0 && i > 0 && lens[i - 1] == lens[i] && run >= 3) {
+			if (run > 6) run = 6;
+			cl[ncl] = 16;
+			clextra[ncl++] = run - 3;
+		} else {
+			run = 1;
+			cl[ncl++] = lens[i];
+		}
+		++clfreq[cl[ncl - 1]];
+		i += run;
+	}
+	deflate_huffman(clfreq, 19, 7, cllen);
+	int nclcodes = 19;
+	while (nclcodes > 4 && !cllen[CLORDER[nclcodes - 1]]) --nclcodes;
+	
+	long dyncost = 5 + 5 + 4 + 3 * nclcodes, fixedcost = 0;
+	for (int i = 0; i < ncl; ++i) {
+		dyncost += cllen[cl[i]] + (cl[i] == 16 ? 2 : cl[i] == 17 ? 3 : cl[i] == 18 ? 7 : 0);
+	}
+	for (int i = 0; i < 286; ++i) {
+		int extra = i > 256 ? LENEXTRA[i - 257] : 0;
+		dyncost += (long) litfreq[i] * (litlen[i] + extra);
+		fixedcost += (long) litfreq[i] * ((i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8) + extra);
+	}
+	for (int i = 0; i < 30; ++i) {
+		dyncost += (long) distfreq[i] * (distlen[i] + DISTEXTRA[i]);
+		fixedcost += (long) distfreq[i] * (5 + DISTEXTRA[i]);
+	}
+	uint16_t litcode[288], distcodes[30];
+	if (fixedcost <= dyncost) {
+		for (int i = 0; i < 288; ++i) {
+			litlen[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+		}
+		memset(distlen, 5, sizeof(distlen));
+		if (deflate_put(d, 1 << 1, 3) < 0) return -1;
+	} else {
+		uint16_t clcode[19];
+		deflate_codes(cllen, 19, clcode);
+		if (deflate_put(d, 2 << 1, 3) < 0) return -1;
+		if (deflate_put(d, nlit - 257, 5) < 0 || deflate_put(d, ndist - 1, 5) < 0) return -1;
+		if (deflate_put(d, nclcodes - 4, 4) < 0) return -1;
+		for (int i = 0; i < nclcodes; ++i) {
+			if (deflate_put(d, cllen[CLORDER[i]], 3) < 0) return -1;
+		}
+		for (int i = 0; i < ncl; ++i) {
+			if (deflate_put(d, clcode[cl[i]], cllen[cl[i]]) < 0) return -1;
+			if (cl[i] >= 16 && deflate_put(d, clextra[i], cl[i] == 16 ? 2 : cl[i] == 17 ? 3 : 7) < 0) return -1;
+		}
+	}
+	deflate_codes(litlen, 288, litcode);
+	deflate_codes(distlen, 30, distcodes);
+	for (int i = 0; i < d->nsyms; ++i) {
+		int len = d->syms[i][0], dist = d->syms[i][1];
+		if (!dist) {
+			if (deflate_put(d, litcode[len], litlen[len]) < 0) return -1;
+			continue;
+		}
+		int lc = d->lencode[len], dc = d->distcode[dist <= 256 ? dist - 1 : 256 + ((dist - 1) >> 7)];
+		if (deflate_put(d, litcode[257 + lc], litlen[257 + lc]) < 0) return -1;
+		if (deflate_put(d, len - LENBASE[lc], LENEXTRA[lc]) < 0) return -1;
+		if (deflate_put(d, distcodes[dc], distlen[dc]) < 0) return -1;
+		if (deflate_put(d, dist - DISTBASE[dc], DISTEXTRA[dc]) < 0) return -1;
+	}
+	d->nsyms = 0;
+	return deflate_put(d, litcode[256], litlen[256]);
+}
+
+void
+deflate_codes(const uint8_t *len, int n, uint16_t *code)
+{
+	// Canonical codes for the given lengths, bit reversed since deflate sends
+	// Huffman codes starting with their most significant bit
+	int count[16] = {}, next[16];
+	for (int i = 0; i < n; ++i) ++count[len[i]];
+	count[0] = 0;
+	next[0] = 0;
+	for (int l = 1; l < 16; ++l) next[l] = (next[l - 1] + count[l - 1]) << 1;
+	for (int i = 0; i < n; ++i) {
+		if (!len[i]) continue;
+		int c = next[len[i]]++, r = 0;
+		for (int b = 0; b < len[i]; ++b) r |= (c >> b & 1) << (len[i] - 1 - b);
+		code[i] = r;
+	}
+}
+
+void
+deflate_huffman(const int *freq, int n, int limit, uint8_t *len)
+{
+	// Huffman code lengths, with the frequencies flattened until no code is longer than limit
+	int weight[2 * 288], parent[2 * 288], sym[288], depth[2 * 288];
+	memset(len, 0, n);
+	for (int shift = 0;; ++shift) {
+		int m = 0;
+		for (int i = 0; i < n; ++i) {
+			if (!freq[i]) continue;
+			sym[m] = i;
+			weight[m++] = shift ? (freq[i] >> shift) | 1 : freq[i];
+		}
+		if (m == 0) return;
+		if (m == 1) {
+			len[sym[0]] = 1;
+			return;
+		}
+		// Join the two lightest nodes until only the root is left
+		int nodes = m;
+		for (int alive = m; alive > 1; --alive) {
+			int a = -1, b = -1;
+			for (int i = 0; i < nodes; ++i) {
+				if (weight[i] < 0) continue;
+				if (a < 0 || weight[i] < weight[a]) {
+					b = a;
+					a = i;
+				} else if (b < 0 || weight[i] < weight[b]) {
+					b = i;
+				}
+			}
+			weight[nodes] = weight[a] + weight[b];
+			parent[a] = parent[b] = nodes;
+			weight[a] = weight[b] = -1;
+			++nodes;
+		}
+		depth[nodes - 1] = 0;
+		int longest = 0;
+		for (int i = nodes - 2; i >= 0; --i) {
+			depth[i] = depth[parent[i]] + 1;
+			if (i < m && depth[i] > longest) longest = depth[i];
+		}
+		if (longest > limit) continue;
+		for (int i = 0; i < m; ++i) {
+			len[sym[i]] = depth[i];
+		}
+		return;
+	}
+}
+
+void
+deflate_init(struct deflate *d, int level)
+{
+	static const int chains[10] = { 0, 4, 8, 16, 32, 64, 128, 256, 1024, 4096 };
+	d->out = NULL;
+	d->len = d->cap = 0;
+	d->bits = 0;
+	d->nbits = 0;
+	d->chain = chains[level < 0 ? 0 : level > 9 ? 9 : level];
+	d->nsyms = 0;
+	memset(d->head, -1, sizeof(d->head));
+	for (int c = 0, len = 3; c < 29; ++c) {
+		int n = c == 28 ? 1 : 1 << (c < 8 ? 0 : (c - 4) / 4);
+		for (int i = 0; i < n && len <= 258; ++i) d->lencode[len++] = c;
+	}
+	d->lencode[258] = 28;
+	// Distances up to 256 are looked up directly, longer ones by what's left after
+	// dropping their lowest 7 bits
+	for (int c = 0, dist = 0; c < 16; ++c) {
+		for (int i = 0; i < 1 << (c < 4 ? 0 : (c - 2) / 2); ++i) d->distcode[dist++] = c;
+	}
+	for (int c = 16, dist = 256 + 2; c < 30; ++c) {
+		for (int i = 0; i < 1 << ((c - 2) / 2 - 7); ++i) d->distcode[dist++] = c;
+	}
+}
+
+int
+deflate_put(struct deflate *d, uint32_t v, int n)
+{
+	// Appends the n lowest bits of v, or pads to a whole byte for n < 0
+	if (n < 0) n = (8 - d->nbits % 8) % 8;
+	for (; n > 0; n -= 8) {
+		int k = n < 8 ? n : 8;
+		d->bits |= (v & ((1u << k) - 1)) << d->nbits;
+		d->nbits += k;
+		v >>= k;
+		while (d->nbits >= 8) {
+			if (d->len == d->cap) {
+				size_t cap = d->cap ? d->cap * 2 : 65536;
+				unsigned char *out = realloc(d->out, cap);
+				if (!out) return -1;
+				d->out = out;
+				d->cap = cap;
+			}
+			d->out[d->len++] = d->bits;
+			d->bits >>= 8;
+			d->nbits -= 8;
+		}
+	}
+	return 0;
+}
+
 int
 dialog_save(struct editor *ed)
 {
@@ -166,17 +1230,85 @@ dialog_save(struct editor *ed)
 		} break;
 		}
 	}
-saveit:
-	if (!FORMATS[sel].savefn(ed->filepath, ed->w, ed->h, 4, ed->data)) {
+saveit:;
+	// The file is written in the background from a snapshot of the image
+	struct savejob *sj = calloc(1, sizeof(struct savejob));
+	if (!sj) {
 		ret = -1;
-	} else {
-		ret = 1;
+		goto end;
 	}
+	sj->job.fn = jobfn_save;
+	sj->job.done = donefn_save;
+	sj->filepath = strdup(ed->filepath);
+	sj->format = sel;
+	sj->ed = ed;
+	sj->result = -1;
+	image_snapshot(&sj->img, &ed->img);
+	ed->save = sj;
+	job_submit(&sj->job);
+	ret = 1;
 end:;
 	ncplane_destroy(ncp);
 	return ret;
 }
 
+struct rgba *
+edit_row(struct editor *ed, int x, int y, int *n)
+{
+	if (edit_tile(ed, (x >> TILE_SHIFT) + (y >> TILE_SHIFT) * ed->img.tw) < 0) return NULL;
+	return image_row(&ed->img, x, y, n);
+}
+
+int
+edit_span(struct editor *ed, int x0, int x1, int y, struct rgba rgba)
+{
+	for (int n; x0 <= x1; x0 += n) {
+		struct rgba *row = edit_row(ed, x0, y, &n);
+		if (!row) return -1;
+		if (n > x1 - x0 + 1) n = x1 - x0 + 1;
+		for (int i = 0; i < n; ++i) row[i] = rgba;
+	}
+	return 0;
+}
+
+int
+edit_tile(struct editor *ed, int i)
+{
+	// Keeps the tile as it was before the operation, and gives the image its own copy
+	// to modify. Fails if there's no memory for either.
+	image_tile(&ed->img, i);
+	struct tile **t = &ed->img.tiles[i];
+	if (!*t) return -1;
+	if (ed->tilestamp[i] != ed->opstamp) {
+		if (!ed->op && !(ed->op = calloc(1, sizeof(struct undo)))) return -1;
+		struct undo *op = ed->op;
+		if (op->n == op->cap) {
+			int cap = op->cap ? op->cap * 2 : 16;
+			int *idx = realloc(op->idx, cap * sizeof(int));
+			if (!idx) return -1;
+			op->idx = idx;
+			struct tile **tiles = realloc(op->tiles, cap * sizeof(struct tile *));
+			if (!tiles) return -1;
+			op->tiles = tiles;
+			op->cap = cap;
+		}
+		op->idx[op->n] = i;
+		op->tiles[op->n] = *t;
+		++op->n;
+		++(*t)->refs;
+		ed->undobytes += sizeof(struct tile);
+		ed->tilestamp[i] = ed->opstamp;
+	}
+	if ((*t)->refs > 1) {
+		struct tile *copy = tile_dup(*t);
+		if (!copy) return -1;
+		tile_unref(*t);
+		*t = copy;
+	}
+	image_dirty(&ed->img, i);
+	return 0;
+}
+
 int
 dialog_tool(struct editor *ed)
 {
@@ -239,146 +1371,1165 @@ dialog_tool(struct editor *ed)
 		}
 	}
 end:
+	if (ret > 0) ed->anchored = 0;
 	ncplane_destroy(ncp);
 	return ret;
 }
 
 void
-init()
+flood_fill(struct editor *ed, int x, int y, struct rgba rgba)
 {
-	g.nc = notcurses_core_init(&(struct notcurses_options) {
-		.flags = NCOPTION_SUPPRESS_BANNERS
-	}, stdout);
-	g.stdp = notcurses_stddim_yx(g.nc, &g.termh, &g.termw);
-	notcurses_mouse_enable(g.nc);
-	
-	struct ncplane *ncp = ncplane_create(g.stdp, &(struct ncplane_options) {
-		.x = 0, .y = 0,
-		.cols = g.termw,
-		.rows = g.termh
-	});
-	g.tabbed = nctabbed_create(ncp, &(struct nctabbed_options) {
-		.selchan = CHANNELS_RGB_INITIALIZER(0, 0, 0, 220, 220, 220),
-		.separator = " "
-	});
-	
-	struct ncplane *tabp = nctabbed_content_plane(g.tabbed);
-	g.viewplane = ncplane_create(tabp, &(struct ncplane_options) {
-		.x = 0, .y = 1,
-		.cols = g.vieww = g.termw,
-		.rows = g.viewh = g.termh - 2
-	});
+	// Fills the pixels connected to (x, y) whose colour is close enough to the one
+	// there, a horizontal span at a time. Spans still to be done are found through
+	// a stack of seeds instead of recursion, and a bitmap of the filled pixels keeps
+	// them from being filled again, even if the new colour is close enough too.
+	if ((size_t) ed->img.w * ed->img.h >= FILL_PARALLEL_PIXELS && g.nworkers > 1) {
+		flood_fill_tiles(ed, x, y, rgba);
+		return;
+	}
+	int w = ed->img.w, h = ed->img.h;
+	struct rgba seed = image_get(&ed->img, x, y);
+	unsigned char *filled = calloc((size_t) w * h / 8 + 1, 1);
+	int cap = 256, n = 0;
+	int (*stack)[2] = malloc(cap * sizeof(*stack));
+	if (!filled || !stack) {
+		free(filled);
+		free(stack);
+		message("Filling failed");
+		return;
+	}
+	int diag = ed->fill8, x0 = x, y0 = y, x1 = x, y1 = y, failed = 0;
+	stack[n][0] = x;
+	stack[n++][1] = y;
+	while (n) {
+		--n;
+		x = stack[n][0];
+		y = stack[n][1];
+		if (!flood_match(ed, filled, seed, x, y)) continue;
+		int lx = x, rx = x;
+		while (lx > 0 && flood_match(ed, filled, seed, lx - 1, y)) --lx;
+		while (rx < w - 1 && flood_match(ed, filled, seed, rx + 1, y)) ++rx;
+		failed = edit_span(ed, lx, rx, y, rgba) < 0;
+		for (size_t i = lx + (size_t) y * w; i <= rx + (size_t) y * w; ++i) filled[i >> 3] |= 1 << (i & 7);
+		if (lx < x0) x0 = lx;
+		if (rx > x1) x1 = rx;
+		if (y < y0) y0 = y;
+		if (y > y1) y1 = y;
+		if (failed) {
+			message("Filling failed");
+			break;
+		}
+		// Every run of pixels to fill next to the span in the rows above and below gets a seed
+		for (int ny = y - 1; ny <= y + 1; ny += 2) {
+			if (ny < 0 || ny >= h) continue;
+			int match = 0;
+			for (int i = lx - diag > 0 ? lx - diag : 0; i <= rx + diag && i < w; ++i) {
+				int prev = match;
+				if (!(match = flood_match(ed, filled, seed, i, ny)) || prev) continue;
+				if (n == cap) {
+					int (*grown)[2] = realloc(stack, 2 * cap * sizeof(*stack));
+					if (!grown) {
+						message("Filling failed");
+						n = 0;
+						ny = h;
+						break;
+					}
+					stack = grown;
+					cap *= 2;
+				}
+				stack[n][0] = i;
+				stack[n++][1] = ny;
+			}
+		}
+	}
+	free(filled);
+	free(stack);
+	image_changed(ed, x0, y0, x1 - x0 + 1, y1 - y0 + 1);
 }
 
 void
-main_loop()
+flood_fill_tiles(struct editor *ed, int x, int y, struct rgba rgba)
 {
-	struct ncinput ni;
-	struct editor *ed = nctab_userptr(nctabbed_selected(g.tabbed));
-	while (1) {
-		nctabbed_ensure_selected_header_visible(g.tabbed);
-		nctabbed_redraw(g.tabbed);
-		notcurses_render(g.nc);
-		notcurses_getc_blocking(g.nc, &ni);
-		if (nckey_mouse_p(ni.id)) {
-			int xlim = g.vieww * 2;
-			if (xlim > (ed->w - ed->viewx) * 2) xlim = (ed->w - ed->viewx) * 2;
-			int ylim = 2 + g.viewh;
-			if (ylim > 2 + ed->h - ed->viewy) ylim = 2 + ed->h - ed->viewy;
-			if (ni.y > 1 && ni.x < xlim && ni.y < ylim) {
-				if (ni.id != NCKEY_RELEASE) {
-					ed->curx = ed->viewx + ni.x/2;
-					ed->cury = ed->viewy + ni.y - 2;
-				}
-				TOOLS[ed->tool].fn(ed, &ni);
-			}
-		} else if (ni.ctrl || ni.alt) {
-			switch (ni.id) {
-			case 's':
-			case 'S': {
-				int r = dialog_save(ed);
-				if (r < 0) {
-					message("Saving failed");
-				} else if (r > 0) {
-					message("Saved");
-				} else {
-					message("Saving cancelled");
+	// Fills the same pixels as flood_fill, in rounds. In each one the tiles with
+	// spans to look at are filled in parallel, each by its own job which touches
+	// only that tile. Spans reaching into other tiles are handed to them for the
+	// next round.
+	int ntiles = ed->img.tw * ed->img.th, failed = 0;
+	struct flood flood = { &ed->img, calloc(ntiles, sizeof(*flood.filled)), image_get(&ed->img, x, y), rgba, ed->filltolerance, ed->fill8 };
+	struct floodtile *tiles = calloc(ntiles, sizeof(struct floodtile));
+	struct job **jobs = calloc(ntiles, sizeof(struct job *));
+	int *pending = calloc(ntiles, sizeof(int)), npending = 0;
+	int x0 = ed->img.w, y0 = ed->img.h, x1 = -1, y1 = -1;
+	if (!flood.filled || !tiles || !jobs || !pending) {
+		failed = 1;
+		goto end;
+	}
+	for (int i = 0; i < ntiles; ++i) {
+		struct floodtile *ft = &tiles[i];
+		ft->job.fn = jobfn_floodtile;
+		ft->flood = &flood;
+		ft->i = i;
+		ft->x0 = ed->img.w;
+		ft->y0 = ed->img.h;
+		ft->x1 = ft->y1 = -1;
+	}
+	pending[npending++] = (x >> TILE_SHIFT) + (y >> TILE_SHIFT) * ed->img.tw;
+	failed = !floodspans_add(&tiles[pending[0]].seeds, x, x, y);
+	while (npending && !failed) {
+		// Only tiles with something to fill are copied for undo
+		int n = 0;
+		for (int k = 0; k < npending; ++k) {
+			struct floodtile *ft = &tiles[pending[k]];
+			if (floodtile_pending(ft)) {
+				if (edit_tile(ed, ft->i) < 0) {
+					failed = 1;
+					break;
 				}
-			} break;
+				jobs[n++] = &ft->job;
+			} else {
+				ft->seeds.n = 0;
 			}
-		} else {
-			switch (ni.id) {
-			case 'q': {
-				free(ed->filepath);
-				stbi_image_free(ed->data);
-				free(ed);
-				nctabbed_del(g.tabbed, nctabbed_selected(g.tabbed));
-				if (nctabbed_tabcount(g.tabbed) == 0) {
-					return;
-				} else {
-					ed = nctab_userptr(nctabbed_selected(g.tabbed));
-				}
-			} break;
-			case NCKEY_LEFT: {
-				ed = nctab_userptr(nctabbed_prev(g.tabbed));
-			} break;
-			case NCKEY_RIGHT: {
-				ed = nctab_userptr(nctabbed_next(g.tabbed));
-			} break;
-			case 'A': {
-				if (ed->viewx > 0) --ed->viewx;
-				if (ed->curx > ed->viewx + g.vieww/2 - 1) --ed->curx;
-			} break;
-			case 'D': {
-				if (ed->viewx < ed->w - 1) ++ed->viewx;
-				if (ed->curx < ed->viewx) ++ed->curx;
-			} break;
-			case 'W': {
-				if (ed->viewy > 0) --ed->viewy;
-				if (ed->cury > ed->viewy + g.viewh - 1) --ed->cury;
-			} break;
-			case 'S': {
-				if (ed->viewy < ed->h - 1) ++ed->viewy;
-				if (ed->cury < ed->viewy) ++ed->cury;
-			} break;
-			case 'a': {
-				if (ed->curx > 0) --ed->curx;
-				if (ed->curx < ed->viewx) --ed->viewx;
-			} break;
-			case 'd': {
-				if (ed->curx < ed->w - 1) ++ed->curx;
-				if (ed->curx > ed->viewx + g.vieww/2 - 1) ++ed->viewx;
-			} break;
-			case 'w': {
-				if (ed->cury > 0) --ed->cury;
-				if (ed->cury < ed->viewy) --ed->viewy;
-			} break;
-			case 's': {
-				if (ed->cury < ed->h - 1) ++ed->cury;
-				if (ed->cury > ed->viewy + g.viewh - 1) ++ed->viewy;
-			} break;
-			case 't': {
-				int r = dialog_tool(ed);
-				if (r > 0) {
-					message("Selected tool");
-				} else if (r < 0) {
-					message("Failed to select tool");
-				} else {
-					message("Tool selection cancelled");
-				}
-			} break;
-			case '1': {
-				ed->tool = TOOL_DRAW;
-			} break;
-			case '2': {
-				ed->tool = TOOL_PIPETTE;
-			} break;
-			case NCKEY_SPACE:
-			case NCKEY_ENTER: {
-				TOOLS[ed->tool].fn(ed, &ni);
-			} break;
+		}
+		jobs_run(jobs, n);
+		npending = 0;
+		for (int k = 0; k < n; ++k) {
+			struct floodtile *ft = (struct floodtile *) jobs[k];
+			failed |= ft->failed;
+			if (ft->x0 < x0) x0 = ft->x0;
+			if (ft->y0 < y0) y0 = ft->y0;
+			if (ft->x1 > x1) x1 = ft->x1;
+			if (ft->y1 > y1) y1 = ft->y1;
+			for (int j = 0; j < ft->out.n; ++j) {
+				int *span = ft->out.span[j];
+				struct floodtile *to = &tiles[(span[0] >> TILE_SHIFT) + (span[2] >> TILE_SHIFT) * ed->img.tw];
+				if (!to->seeds.n) pending[npending++] = to->i;
+				if (!floodspans_add(&to->seeds, span[0], span[1], span[2])) failed = 1;
+			}
+			ft->out.n = 0;
+		}
+		// Like building the mips, a big fill stays within the tile memory budget
+		__atomic_add_fetch(&g.tileclock, 1, __ATOMIC_RELAXED);
+		tiles_evict();
+	}
+end:
+	if (failed) message("Filling failed");
+	for (int i = 0; tiles && i < ntiles; ++i) {
+		free(tiles[i].seeds.span);
+		free(tiles[i].out.span);
+	}
+	free(flood.filled);
+	free(tiles);
+	free(jobs);
+	free(pending);
+	if (x1 >= x0) image_changed(ed, x0, y0, x1 - x0 + 1, y1 - y0 + 1);
+}
+
+int
+flood_match(struct editor *ed, const unsigned char *filled, struct rgba seed, int x, int y)
+{
+	size_t i = x + (size_t) y * ed->img.w;
+	if (filled[i >> 3] & 1 << (i & 7)) return 0;
+	struct rgba p = image_get(&ed->img, x, y);
+	int t = ed->filltolerance;
+	return abs(p.r - seed.r) <= t && abs(p.g - seed.g) <= t && abs(p.b - seed.b) <= t && abs(p.a - seed.a) <= t;
+}
+
+int
+floodspans_add(struct floodspans *s, int x0, int x1, int y)
+{
+	if (s->n == s->cap) {
+		int cap = s->cap ? s->cap * 2 : 16;
+		int (*span)[3] = realloc(s->span, cap * sizeof(*span));
+		if (!span) return 0;
+		s->span = span;
+		s->cap = cap;
+	}
+	s->span[s->n][0] = x0;
+	s->span[s->n][1] = x1;
+	s->span[s->n++][2] = y;
+	return 1;
+}
+
+int
+floodtile_match(struct flood *flood, int x, int y)
+{
+	int i = (x >> TILE_SHIFT) + (y >> TILE_SHIFT) * flood->img->tw;
+	int j = (x & TILE_MASK) + ((y & TILE_MASK) << TILE_SHIFT);
+	if (flood->filled[i][j >> 3] & 1 << (j & 7)) return 0;
+	struct rgba p = image_tile(flood->img, i)->px[j];
+	int t = flood->tolerance;
+	return abs(p.r - flood->seed.r) <= t && abs(p.g - flood->seed.g) <= t && abs(p.b - flood->seed.b) <= t && abs(p.a - flood->seed.a) <= t;
+}
+
+int
+floodtile_pending(struct floodtile *ft)
+{
+	for (int k = 0; k < ft->seeds.n; ++k) {
+		int *span = ft->seeds.span[k];
+		for (int x = span[0]; x <= span[1]; ++x) {
+			if (floodtile_match(ft->flood, x, span[2])) return 1;
+		}
+	}
+	return 0;
+}
+
+int
+floodtile_push(struct floodtile *ft, int x0, int x1, int y)
+{
+	// Splits the span at tile borders, keeping the part in this tile
+	struct image *img = ft->flood->img;
+	if (y < 0 || y >= img->h) return 1;
+	if (x0 < 0) x0 = 0;
+	if (x1 >= img->w) x1 = img->w - 1;
+	int own = y >> TILE_SHIFT == ft->i / img->tw;
+	for (int x = x0; x <= x1; x = (x | TILE_MASK) + 1) {
+		int end = (x | TILE_MASK) < x1 ? x | TILE_MASK : x1;
+		int ok = own && x >> TILE_SHIFT == ft->i % img->tw ? floodspans_add(&ft->seeds, x, end, y) : floodspans_add(&ft->out, x, end, y);
+		if (!ok) return 0;
+	}
+	return 1;
+}
+
+void
+free_editor(struct editor *ed)
+{
+	if (ed->load) {
+		// The tiles shown so far still belong to the decoder
+		ed->load->ed = NULL;
+		ed->img.tiles = NULL;
+	}
+	if (ed->save) ed->save->ed = NULL;
+	for (int i = 0; i < MAX_ZOOM_OUT; ++i) {
+		if (ed->mips[i].data) g.mipbytes -= (size_t) ed->mips[i].w * ed->mips[i].h * sizeof(struct rgba);
+		free(ed->mips[i].data);
+	}
+	while (ed->history) {
+		struct undo *next = ed->history->next;
+		undo_free(ed, ed->history);
+		ed->history = next;
+	}
+	if (ed->op) undo_free(ed, ed->op);
+	if (ed->spill) fclose(ed->spill);
+	stroke_end(ed);
+	free(ed->brushmask);
+	free(ed->tilestamp);
+	image_free(&ed->img);
+	free(ed->filepath);
+	free(ed);
+}
+
+int
+handle_input(struct ncinput *ni)
+{
+	struct nctab *seltab = nctabbed_selected(g.tabbed);
+	if (!seltab) return 0; // still loading
+	struct editor *ed = nctab_userptr(seltab);
+	// There's nothing to edit before the image is decoded, but the part that is can be looked around
+	int move = (ed->loadpass || ed->loadrows) && ni->id && ni->id < 128 && strchr("wasdWASD", ni->id);
+	if (ed->load && !move && ni->id != 'q' && ni->id != NCKEY_LEFT && ni->id != NCKEY_RIGHT) return 0;
+	// The size of the view, how far it moves at once and how far the cursor moves, in image pixels
+	int vw = to_image(ed, g.viewpw), vh = to_image(ed, g.viewph);
+	int stepx = to_image(ed, g.blockpw), stepy = to_image(ed, g.blockph), step = to_image(ed, 1);
+	if (stepx < 1) stepx = 1;
+	if (stepy < 1) stepy = 1;
+	if (step < 1) step = 1;
+	if (nckey_mouse_p(ni->id)) {
+		int cx = ni->x, cy = ni->y - 2;
+		// Pick the middle view pixel (rounding towards the top left) of the block under the mouse
+		int x = to_view(ed, ed->viewx) + cx / g.blockcw * g.blockpw + (g.blockpw - 1) / 2;
+		int y = to_view(ed, ed->viewy) + cy / g.blockch * g.blockph + (g.blockph - 1) / 2;
+		int inside = cy >= 0 && cx < g.vieww && cy < g.viewh && x < ed->zw && y < ed->zh;
+		if (inside && ni->id != NCKEY_RELEASE) {
+			ed->curx = to_image(ed, x);
+			ed->cury = to_image(ed, y);
+		}
+		if (inside || ni->id == NCKEY_RELEASE) TOOLS[ed->tool].fn(ed, ni);
+		// Everything done while a button is held is undone together
+		ed->mousedown = ni->id == NCKEY_BUTTON1 || ni->id == NCKEY_BUTTON2 || ni->id == NCKEY_BUTTON3;
+		if (!ed->mousedown) {
+			undo_commit(ed);
+			stroke_end(ed);
+		}
+	} else if (ni->ctrl || ni->alt) {
+		switch (ni->id) {
+		case 's':
+		case 'S': {
+			if (ed->save) {
+				message("Already saving");
+				break;
+			}
+			int r = dialog_save(ed);
+			if (r < 0) {
+				message("Saving failed");
+			} else if (r == 0) {
+				message("Saving cancelled");
+			}
+		} break;
+		}
+	} else {
+		switch (ni->id) {
+		case 'q': {
+			if (g.shown == ed) g.shown = NULL;
+			free_editor(ed);
+			nctabbed_del(g.tabbed, nctabbed_selected(g.tabbed));
+			if (nctabbed_tabcount(g.tabbed) == 0) {
+				return 1;
+			}
+		} break;
+		case NCKEY_LEFT: {
+			nctabbed_prev(g.tabbed);
+		} break;
+		case NCKEY_RIGHT: {
+			nctabbed_next(g.tabbed);
+		} break;
+		// The view moves by whole blocks so that already drawn cells can be reused
+		case 'A': {
+			ed->viewx = ed->viewx > stepx ? ed->viewx - stepx : 0;
+			if (ed->curx > ed->viewx + vw - 1) ed->curx = ed->viewx + vw - 1;
+		} break;
+		case 'D': {
+			if (ed->viewx + stepx < ed->img.w) ed->viewx += stepx;
+			if (ed->curx < ed->viewx) ed->curx = ed->viewx;
+		} break;
+		case 'W': {
+			ed->viewy = ed->viewy > stepy ? ed->viewy - stepy : 0;
+			if (ed->cury > ed->viewy + vh - 1) ed->cury = ed->viewy + vh - 1;
+		} break;
+		case 'S': {
+			if (ed->viewy + stepy < ed->img.h) ed->viewy += stepy;
+			if (ed->cury < ed->viewy) ed->cury = ed->viewy;
+		} break;
+		case 'a': {
+			ed->curx = ed->curx > step ? ed->curx - step : 0;
+			if (ed->curx < ed->viewx) ed->viewx = ed->viewx > stepx ? ed->viewx - stepx : 0;
+		} break;
+		case 'd': {
+			if (ed->curx + step < ed->img.w) ed->curx += step;
+			if (ed->curx > ed->viewx + vw - 1) ed->viewx += stepx;
+		} break;
+		case 'w': {
+			ed->cury = ed->cury > step ? ed->cury - step : 0;
+			if (ed->cury < ed->viewy) ed->viewy = ed->viewy > stepy ? ed->viewy - stepy : 0;
+		} break;
+		case 's': {
+			if (ed->cury + step < ed->img.h) ed->cury += step;
+			if (ed->cury > ed->viewy + vh - 1) ed->viewy += stepy;
+		} break;
+		case '+': {
+			if (set_zoom(ed, ed->zoom - 1)) message("Can't zoom in any further");
+		} break;
+		case '-': {
+			int r = set_zoom(ed, ed->zoom + 1);
+			if (r) message(r > 0 ? "Can't zoom out any further" : "Not enough memory to zoom out");
+		} break;
+		case 'v': {
+			enum rendermode mode = (g.render + 1) % NRENDERMODES;
+			if (set_rendermode(mode) < 0) {
+				mode = (mode + 1) % NRENDERMODES;
+				set_rendermode(mode);
+			}
+			char msg[64];
+			snprintf(msg, sizeof(msg), "Render mode: %s", RENDERMODES[mode].name);
+			message(msg);
+		} break;
+		case 't': {
+			int r = dialog_tool(ed);
+			if (r > 0) {
+				message("Selected tool");
+			} else if (r < 0) {
+				message("Failed to select tool");
+			} else {
+				message("Tool selection cancelled");
+			}
+		} break;
+		// In the order of TOOLS
+		case '1':
+		case '2':
+		case '3':
+		case '4':
+		case '5':
+		case '6': {
+			ed->tool = ni->id - '1';
+			ed->anchored = 0;
+		} break;
+		case '[':
+		case ']': {
+			int t = ed->filltolerance + (ni->id == ']' ? 8 : -8);
+			ed->filltolerance = t < 0 ? 0 : t > 255 ? 255 : t;
+		} break;
+		case 'c': {
+			ed->fill8 = !ed->fill8;
+		} break;
+		case 'f': {
+			ed->filled = !ed->filled;
+		} break;
+		case ',':
+		case '.': {
+			int r = ed->brushradius + (ni->id == '.' ? 1 : -1);
+			ed->brushradius = r < 0 ? 0 : r > MAX_BRUSH_RADIUS ? MAX_BRUSH_RADIUS : r;
+			free(ed->brushmask);
+			ed->brushmask = NULL;
+		} break;
+		case '<':
+		case '>': {
+			int h = ed->brushhardness + (ni->id == '>' ? 10 : -10);
+			ed->brushhardness = h < 0 ? 0 : h > 100 ? 100 : h;
+			free(ed->brushmask);
+			ed->brushmask = NULL;
+		} break;
+		case 'm': {
+			ed->blend = (ed->blend + 1) % NBLENDMODES;
+			char msg[64];
+			snprintf(msg, sizeof(msg), "Blend mode: %s", BLENDMODES[ed->blend]);
+			message(msg);
+		} break;
+		case 'b': {
+			ed->brushround = !ed->brushround;
+			free(ed->brushmask);
+			ed->brushmask = NULL;
+		} break;
+		case 'u': {
+			int r = undo(ed);
+			if (r) message(r > 0 ? "Nothing to undo" : "Undo failed");
+		} break;
+		case 'U': {
+			int r = redo(ed);
+			if (r) message(r > 0 ? "Nothing to redo" : "Redo failed");
+		} break;
+		case NCKEY_SPACE:
+		case NCKEY_ENTER: {
+			TOOLS[ed->tool].fn(ed, ni);
+			undo_commit(ed);
+		} break;
+		}
+	}
+	return 0;
+}
+
+void
+image_changed(struct editor *ed, int x, int y, int w, int h)
+{
+	if (w > ed->img.w - x) w = ed->img.w - x;
+	if (h > ed->img.h - y) h = ed->img.h - y;
+	mip_update(ed, x, y, w, h);
+	damage(ed, x, y, w, h);
+}
+
+void
+image_dirty(struct image *img, int i)
+{
+	// Tile i was changed, so neither the mapped file nor the scratch file has it anymore
+	if (img->dirty) img->dirty[i] = 1;
+	if (img->slots && img->slots[i] >= 0) {
+		scratch_unref(img->slots[i]);
+		img->slots[i] = -1;
+	}
+}
+
+struct rgba *
+image_flatten(struct image *img, struct job *job)
+{
+	// Counts as the first half of saving, if done for a job
+	struct rgba *data = malloc((size_t) img->w * img->h * sizeof(struct rgba));
+	if (!data) return NULL;
+	for (int y = 0; y < img->h; ++y) {
+		for (int x = 0, n; x < img->w; x += n) {
+			struct rgba *row = image_row(img, x, y, &n);
+			memcpy(&data[x + (size_t) y * img->w], row, n * sizeof(struct rgba));
+		}
+		if (job && (y & TILE_MASK) == TILE_MASK) job_progress(job, 50 * y / img->h);
+	}
+	return data;
+}
+
+void
+image_free(struct image *img)
+{
+	for (int i = 0; img->tiles && i < img->tw * img->th; ++i) {
+		tile_unref(img->tiles[i]);
+	}
+	free(img->tiles);
+	img->tiles = NULL;
+	if (img->map) imagemap_unref(img->map);
+	img->map = NULL;
+	free(img->dirty);
+	img->dirty = NULL;
+	for (int i = 0; img->slots && i < img->tw * img->th; ++i) {
+		if (img->slots[i] >= 0) scratch_unref(img->slots[i]);
+	}
+	free(img->slots);
+	img->slots = NULL;
+	free(img->used);
+	img->used = NULL;
+}
+
+int
+image_alloc(struct image *img, int w, int h)
+{
+	if (image_init(img, w, h) < 0) return -1;
+	for (int ty = 0; ty < img->th; ++ty) {
+		if (image_alloc_row(img, ty) < 0) {
+			image_free(img);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int
+image_alloc_row(struct image *img, int ty)
+{
+	for (int i = ty * img->tw; i < (ty + 1) * img->tw; ++i) {
+		if (!(img->tiles[i] = calloc(1, sizeof(struct tile)))) return -1;
+		img->tiles[i]->refs = 1;
+	}
+	return 0;
+}
+
+int
+image_from_rgba(struct image *img, const struct rgba *data, int w, int h)
+{
+	if (image_alloc(img, w, h) < 0) return -1;
+	for (int y = 0; y < h; ++y) {
+		for (int x = 0, n; x < w; x += n) {
+			struct rgba *row = image_row(img, x, y, &n);
+			memcpy(row, &data[x + (size_t) y * w], n * sizeof(struct rgba));
+		}
+	}
+	return 0;
+}
+
+struct rgba
+image_get(struct image *img, int x, int y)
+{
+	struct tile *t = image_tile(img, (x >> TILE_SHIFT) + (y >> TILE_SHIFT) * img->tw);
+	return t->px[(x & TILE_MASK) + ((y & TILE_MASK) << TILE_SHIFT)];
+}
+
+int
+image_init(struct image *img, int w, int h)
+{
+	// The tiles are left to be allocated or read when needed
+	img->w = w;
+	img->h = h;
+	img->tw = (w + TILE_SIZE - 1) >> TILE_SHIFT;
+	img->th = (h + TILE_SIZE - 1) >> TILE_SHIFT;
+	img->tiles = calloc(img->tw * img->th, sizeof(struct tile *));
+	return img->tiles ? 0 : -1;
+}
+
+struct rgba *
+image_row(struct image *img, int x, int y, int *n)
+{
+	// Returns the pixel at (x, y) and sets n to how many pixels after it (including
+	// itself) are next to each other in memory, up to the end of the tile or row
+	struct tile *t = image_tile(img, (x >> TILE_SHIFT) + (y >> TILE_SHIFT) * img->tw);
+	*n = TILE_SIZE - (x & TILE_MASK);
+	if (*n > img->w - x) *n = img->w - x;
+	return &t->px[(x & TILE_MASK) + ((y & TILE_MASK) << TILE_SHIFT)];
+}
+
+void
+image_snapshot(struct image *dst, struct image *src)
+{
+	*dst = *src;
+	dst->tiles = malloc(src->tw * src->th * sizeof(struct tile *));
+	for (int i = 0; i < src->tw * src->th; ++i) {
+		dst->tiles[i] = src->tiles[i];
+		if (dst->tiles[i]) ++dst->tiles[i]->refs;
+	}
+	if (src->map) {
+		++src->map->refs;
+		dst->dirty = malloc(src->tw * src->th);
+		memcpy(dst->dirty, src->dirty, src->tw * src->th);
+	}
+	if (src->slots) {
+		dst->slots = malloc(src->tw * src->th * sizeof(int));
+		for (int i = 0; i < src->tw * src->th; ++i) {
+			dst->slots[i] = src->slots[i];
+			if (dst->slots[i] >= 0) ++g.scratchrefs[dst->slots[i]];
+		}
+	}
+	dst->used = NULL;
+}
+
+struct tile *
+image_tile(struct image *img, int i)
+{
+	// Tiles of a mapped file are only read from it when first needed, and dropped
+	// tiles are read back from wherever a copy of them is. The bands of a PNG being
+	// saved read the same snapshot at once, so the tile is stored only if no other
+	// thread stored it first. A tile that can't be read is shown blank but not
+	// stored, and the image can't be saved anymore, so the blank never replaces
+	// what was there. Flood fill workers stamp tiles as used too, so the stamps and
+	// the clock are accessed atomically.
+	if (img->used) __atomic_store_n(&img->used[i], __atomic_load_n(&g.tileclock, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+	struct tile *t = __atomic_load_n(&img->tiles[i], __ATOMIC_ACQUIRE), *none = NULL;
+	if (t) return t;
+	if (!(t = calloc(1, sizeof(struct tile)))) goto fail;
+	t->refs = 1;
+	if (img->slots && img->slots[i] >= 0) {
+		off_t off = (off_t) img->slots[i] * sizeof(t->px);
+		if (pread(fileno(g.scratch), t->px, sizeof(t->px), off) != sizeof(t->px)) {
+			free(t);
+			goto fail;
+		}
+		goto store;
+	}
+	int x0 = (i % img->tw) << TILE_SHIFT, y0 = (i / img->tw) << TILE_SHIFT;
+	int w = img->w - x0 < TILE_SIZE ? img->w - x0 : TILE_SIZE;
+	int h = img->h - y0 < TILE_SIZE ? img->h - y0 : TILE_SIZE;
+	for (int y = 0; y < h; ++y) {
+		const unsigned char *src = imagemap_row(img->map, img, y0 + y) + x0 * 4;
+		struct rgba *dst = &t->px[y << TILE_SHIFT];
+		if (!img->map->bgra) {
+			memcpy(dst, src, w * 4);
+			continue;
+		}
+		for (int x = 0; x < w; ++x, src += 4) {
+			dst[x] = (struct rgba) { src[2], src[1], src[0], src[3] };
+		}
+	}
+store:
+	if (__atomic_compare_exchange_n(&img->tiles[i], &none, t, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) return t;
+	free(t);
+	return none;
+fail:
+	if (!__atomic_load_n(&img->failed, __ATOMIC_RELAXED)) __atomic_store_n(&img->failed, 1, __ATOMIC_RELAXED);
+	return &g.blanktile;
+}
+
+int
+imagemap_open(const char *filepath, struct image *img)
+{
+	// Maps the file if it's a BMP with an alpha mask or a TGA, both uncompressed
+	// and 32 bit, so that opening it takes no time and only the parts that are
+	// looked at are read. The mapping is shared so that it shows what imagemap_save
+	// writes into the file, as the tiles written are marked clean afterwards.
+	int fd = open(filepath, O_RDONLY);
+	if (fd < 0) return -1;
+	struct stat st;
+	unsigned char *data = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && st.st_size >= 54) {
+		data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	}
+	close(fd);
+	if (data == MAP_FAILED) return -1;
+	struct imagemap m = { 1, 0, data, st.st_size };
+	m.dev = st.st_dev;
+	m.ino = st.st_ino;
+	long w = 0, h = 0;
+	#define LE16(p) ((p)[0] | (p)[1] << 8)
+	#define LE32(p) ((uint32_t) LE16(p) | (uint32_t) LE16((p) + 2) << 16)
+	if (data[0] == 'B' && data[1] == 'M' && m.size >= 70) {
+		uint32_t hdrsize = LE32(data + 14), compression = LE32(data + 30);
+		w = (int32_t) LE32(data + 18);
+		h = (int32_t) LE32(data + 22);
+		m.format = FORMAT_BMP;
+		m.off = LE32(data + 10);
+		m.bottomup = h > 0;
+		if (h < 0) h = -h;
+		// The channel masks follow the header fields BMP versions have in common
+		int masks = compression == 6 || (compression == 3 && hdrsize >= 56);
+		if (LE16(data + 28) != 32 || !masks || LE32(data + 66) != 0xFF000000) {
+			w = 0;
+		} else if (LE32(data + 54) == 0x00FF0000 && LE32(data + 58) == 0xFF00 && LE32(data + 62) == 0xFF) {
+			m.bgra = 1;
+		} else if (!(LE32(data + 54) == 0xFF && LE32(data + 58) == 0xFF00 && LE32(data + 62) == 0x00FF0000)) {
+			w = 0;
+		}
+	} else if (data[1] == 0 && data[2] == 2 && data[16] == 32 && !(data[17] & 0x10)) {
+		w = LE16(data + 12);
+		h = LE16(data + 14);
+		m.format = FORMAT_TGA;
+		m.off = 18 + data[0];
+		m.bottomup = !(data[17] & 0x20);
+		m.bgra = 1;
+	}
+	#undef LE16
+	#undef LE32
+	if (w <= 0 || h <= 0 || w > INT32_MAX / 4 || m.off > m.size || (m.size - m.off) / 4 / w < (size_t) h) {
+		munmap(data, st.st_size);
+		return -1;
+	}
+	img->w = w;
+	img->h = h;
+	img->tw = (w + TILE_SIZE - 1) >> TILE_SHIFT;
+	img->th = (h + TILE_SIZE - 1) >> TILE_SHIFT;
+	img->tiles = calloc(img->tw * img->th, sizeof(struct tile *));
+	img->dirty = calloc(img->tw * img->th, 1);
+	img->map = malloc(sizeof(struct imagemap));
+	if (!img->tiles || !img->dirty || !img->map) {
+		free(img->map);
+		img->map = NULL;
+		image_free(img);
+		munmap(data, st.st_size);
+		return -1;
+	}
+	*img->map = m;
+	return 0;
+}
+
+const unsigned char *
+imagemap_row(struct imagemap *m, struct image *img, int y)
+{
+	return m->data + m->off + (size_t) (m->bottomup ? img->h - 1 - y : y) * img->w * 4;
+}
+
+int
+imagemap_save(const char *filepath, enum format format, struct image *img, struct job *job)
+{
+	// Saving a mapped image in its own format only needs the changed tiles to be
+	// written into the file. Returns -1 if that's not possible.
+	struct imagemap *m = img->map;
+	struct stat st;
+	if (format != m->format || stat(filepath, &st) < 0) return -1;
+	if (st.st_dev != m->dev || st.st_ino != m->ino || (size_t) st.st_size != m->size) return -1;
+	int fd = open(filepath, O_WRONLY);
+	if (fd < 0) return -1;
+	unsigned char row[TILE_SIZE * 4];
+	int ok = 1, n = img->tw * img->th;
+	for (int i = 0; ok && i < n; ++i) {
+		if (!img->dirty[i]) continue;
+		int x0 = (i % img->tw) << TILE_SHIFT, y0 = (i / img->tw) << TILE_SHIFT;
+		int w = img->w - x0 < TILE_SIZE ? img->w - x0 : TILE_SIZE;
+		int h = img->h - y0 < TILE_SIZE ? img->h - y0 : TILE_SIZE;
+		// A tile that can't be read back isn't written over what's in the file
+		ok = image_tile(img, i) != &g.blanktile;
+		for (int y = 0; ok && y < h; ++y) {
+			const struct rgba *px = &image_tile(img, i)->px[y << TILE_SHIFT];
+			for (int x = 0; x < w; ++x) {
+				struct rgba p = px[x];
+				unsigned char *dst = &row[x * 4];
+				dst[0] = m->bgra ? p.b : p.r;
+				dst[1] = p.g;
+				dst[2] = m->bgra ? p.r : p.b;
+				dst[3] = p.a;
+			}
+			off_t off = imagemap_row(m, img, y0 + y) - m->data + x0 * 4;
+			ok = pwrite(fd, row, w * 4, off) == w * 4;
+		}
+		if (job) job_progress(job, 100 * i / n);
+	}
+	if (close(fd) < 0) ok = 0;
+	return ok;
+}
+
+void
+imagemap_unref(struct imagemap *m)
+{
+	if (--m->refs) return;
+	munmap(m->data, m->size);
+	free(m);
+}
+
+int
+inflate_block(struct inflate *s)
+{
+	// Returns -1 if the data is broken or doesn't fit in out
+	int type = inflate_get(s, 3);
+	s->final = type & 1;
+	type >>= 1;
+	if (type == 0) {
+		// Stored blocks start at a byte boundary, with whole bytes left in bits
+		inflate_get(s, s->nbits & 7);
+		int len = inflate_get(s, 16), nlen = inflate_get(s, 16);
+		if (len != (~nlen & 0xFFFF) || (size_t) len > s->cap - s->len) return -1;
+		for (; len && s->nbits; --len, s->nbits -= 8, s->bits >>= 8) {
+			s->out[s->len++] = s->bits;
+		}
+		if (s->end - s->in < len) return -1;
+		memcpy(s->out + s->len, s->in, len);
+		s->in += len;
+		s->len += len;
+		return s->pad * 8 > s->nbits ? -1 : 0;
+	}
+	uint8_t lens[288 + 32];
+	if (type == 1) {
+		for (int i = 0; i < 288; ++i) {
+			lens[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+		}
+		if (inflate_table(s->lit, lens, 288) < 0) return -1;
+		memset(lens, 5, 30);
+		if (inflate_table(s->dist, lens, 30) < 0) return -1;
+	} else if (type == 2) {
+		int nlit = inflate_get(s, 5) + 257, ndist = inflate_get(s, 5) + 1, nclcodes = inflate_get(s, 4) + 4;
+		uint8_t cllen[19] = {};
+		for (int i = 0; i < nclcodes; ++i) {
+			cllen[CLORDER[i]] = inflate_get(s, 3);
+		}
+		// The code length codes go into dist for now, which isn't needed yet
+		if (nlit > 286 || ndist > 30 || inflate_table(s->dist, cllen, 19) < 0) return -1;
+		for (int i = 0; i < nlit + ndist;) {
+			int sym = inflate_symbol(s, s->dist), len = 0, run;
+			if (sym < 0) return -1;
+			if (sym < 16) {
+				lens[i++] = sym;
+				continue;
+			} else if (sym == 16) {
+				if (i == 0) return -1;
+				len = lens[i - 1];
+				run = 3 + inflate_get(s, 2);
+			} else if (sym == 17) {
+				run = 3 + inflate_get(s, 3);
+			} else {
+				run = 11 + inflate_get(s, 7);
 			}
+			if (i + run > nlit + ndist) return -1;
+			memset(lens + i, len, run);
+			i += run;
+		}
+		if (inflate_table(s->lit, lens, nlit) < 0 || inflate_table(s->dist, lens + nlit, ndist) < 0) return -1;
+	} else {
+		return -1;
+	}
+	while (1) {
+		int sym = inflate_symbol(s, s->lit);
+		if (sym < 0) return -1;
+		if (sym < 256) {
+			if (s->len == s->cap) return -1;
+			s->out[s->len++] = sym;
+			continue;
+		}
+		if (sym == 256) break;
+		if ((sym -= 257) >= 29) return -1;
+		int len = LENBASE[sym] + inflate_get(s, LENEXTRA[sym]);
+		int dc = inflate_symbol(s, s->dist);
+		if (dc < 0 || dc >= 30) return -1;
+		size_t dist = DISTBASE[dc] + inflate_get(s, DISTEXTRA[dc]);
+		if (dist > s->len || (size_t) len > s->cap - s->len) return -1;
+		// Byte by byte, since the copy may overlap with itself
+		unsigned char *p = s->out + s->len;
+		const unsigned char *q = p - dist;
+		for (int i = 0; i < len; ++i) p[i] = q[i];
+		s->len += len;
+	}
+	return s->pad * 8 > s->nbits ? -1 : 0;
+}
+
+int
+inflate_get(struct inflate *s, int n)
+{
+	// Reading past the end gives zeros, which pad keeps count of
+	while (s->nbits <= 24) {
+		if (s->in < s->end) {
+			s->bits |= (uint32_t) *s->in++ << s->nbits;
+		} else {
+			++s->pad;
+		}
+		s->nbits += 8;
+	}
+	int v = s->bits & ((1u << n) - 1);
+	s->bits >>= n;
+	s->nbits -= n;
+	return v;
+}
+
+int
+inflate_symbol(struct inflate *s, const uint16_t *table)
+{
+	inflate_get(s, 0);
+	int e = table[s->bits & 0x7FFF];
+	if (!e) return -1;
+	inflate_get(s, e >> 9);
+	return e & 511;
+}
+
+int
+inflate_table(uint16_t *table, const uint8_t *len, int n)
+{
+	// Fails for lengths that would give more codes than there are, but not for
+	// fewer, since a single distance code is allowed to have a length of 1
+	int count[16] = {}, left = 1;
+	for (int i = 0; i < n; ++i) ++count[len[i]];
+	for (int l = 1; l < 16; ++l) {
+		left = (left << 1) - count[l];
+		if (left < 0) return -1;
+	}
+	uint16_t code[288];
+	deflate_codes(len, n, code);
+	memset(table, 0, sizeof(uint16_t) << 15);
+	for (int i = 0; i < n; ++i) {
+		if (!len[i]) continue;
+		for (int c = code[i]; c < 1 << 15; c += 1 << len[i]) table[c] = len[i] << 9 | i;
+	}
+	return 0;
+}
+
+int
+init()
+{
+	// The pipe workers wake the main loop with is made first, so that failing to
+	// make it doesn't leave the terminal to be restored
+	if (pipe(g.wakefd) < 0) return -1;
+	if (fcntl(g.wakefd[0], F_SETFL, O_NONBLOCK) < 0 || fcntl(g.wakefd[1], F_SETFL, O_NONBLOCK) < 0) {
+		close(g.wakefd[0]);
+		close(g.wakefd[1]);
+		return -1;
+	}
+	g.nc = notcurses_core_init(&(struct notcurses_options) {
+		.flags = NCOPTION_SUPPRESS_BANNERS
+	}, stdout);
+	if (!g.nc) {
+		close(g.wakefd[0]);
+		close(g.wakefd[1]);
+		return -1;
+	}
+	g.stdp = notcurses_stddim_yx(g.nc, &g.termh, &g.termw);
+	g.undolimit = DEFAULT_UNDO_LIMIT;
+	g.pnglevel = DEFAULT_PNG_LEVEL;
+	g.tilelimit = DEFAULT_TILE_LIMIT;
+	g.pngfilterfn = png_filter_scalar;
+	g.blendfn = blend_scalar;
+#ifdef SIMD_X86
+	g.pngfilterfn = __builtin_cpu_supports("avx2") ? png_filter_avx2 : png_filter_sse2;
+	g.blendfn = __builtin_cpu_supports("avx2") ? blend_avx2 : blend_sse2;
+#endif
+	notcurses_mouse_enable(g.nc);
+	
+	pthread_mutex_init(&g.jobmutex, NULL);
+	pthread_cond_init(&g.jobcond, NULL);
+	pthread_cond_init(&g.batchcond, NULL);
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	g.nworkers = ncpus > 0 ? ncpus : 1;
+	
+	struct ncplane *ncp = ncplane_create(g.stdp, &(struct ncplane_options) {
+		.x = 0, .y = 0,
+		.cols = g.termw,
+		.rows = g.termh
+	});
+	g.tabbed = nctabbed_create(ncp, &(struct nctabbed_options) {
+		.selchan = CHANNELS_RGB_INITIALIZER(0, 0, 0, 220, 220, 220),
+		.separator = " "
+	});
+	
+	struct ncplane *tabp = nctabbed_content_plane(g.tabbed);
+	g.viewplane = ncplane_create(tabp, &(struct ncplane_options) {
+		.x = 0, .y = 1,
+		.cols = g.vieww = g.termw,
+		.rows = g.viewh = g.termh - 2
+	});
+	set_rendermode(RENDER_CELL);
+	return 0;
+}
+
+int
+input_pending(struct ncinput *ni)
+{
+	uint32_t id = notcurses_get_nblock(g.nc, ni);
+	return id != 0 && id != (uint32_t) -1;
+}
+
+void
+job_prioritize(struct job *job)
+{
+	// Moves a job to the front of the queue if it's still waiting there
+	pthread_mutex_lock(&g.jobmutex);
+	struct job **p = &g.jobs, *prev = NULL;
+	for (; *p && *p != job; prev = *p, p = &(*p)->next);
+	if (*p && prev) {
+		*p = job->next;
+		if (g.jobstail == job) g.jobstail = prev;
+		job->next = g.jobs;
+		g.jobs = job;
+	}
+	pthread_mutex_unlock(&g.jobmutex);
+}
+
+void
+job_progress(struct job *job, int progress)
+{
+	pthread_mutex_lock(&g.jobmutex);
+	job->progress = progress;
+	pthread_mutex_unlock(&g.jobmutex);
+	jobs_wake();
+}
+
+void
+job_submit(struct job *job)
+{
+	job->next = NULL;
+	if (g.jobssync) {
+		job->fn(job);
+		job->next = g.donejobs;
+		g.donejobs = job;
+		jobs_wake();
+		return;
+	}
+	pthread_mutex_lock(&g.jobmutex);
+	if (g.jobstail) {
+		g.jobstail->next = job;
+	} else {
+		g.jobs = job;
+	}
+	g.jobstail = job;
+	pthread_cond_signal(&g.jobcond);
+	pthread_mutex_unlock(&g.jobmutex);
+}
+
+void
+jobs_reap()
+{
+	char buf[64];
+	while (read(g.wakefd[0], buf, sizeof(buf)) > 0);
+	pthread_mutex_lock(&g.jobmutex);
+	struct job *job = g.donejobs, *done = NULL;
+	g.donejobs = NULL;
+	pthread_mutex_unlock(&g.jobmutex);
+	// Finish them in the order they were done
+	while (job) {
+		struct job *next = job->next;
+		job->next = done;
+		done = job;
+		job = next;
+	}
+	while (done) {
+		struct job *next = done->next;
+		done->done(done);
+		done = next;
+	}
+}
+
+void
+jobs_run(struct job **jobs, int n)
+{
+	// Runs the jobs on the worker threads and waits for all of them. Whatever is
+	// still queued is done by the waiting thread itself, so that this also works
+	// from inside a job when all the other workers are busy.
+	struct batch batch = { n };
+	if (g.jobssync || g.jobsstopped) {
+		for (int i = 0; i < n; ++i) jobs[i]->fn(jobs[i]);
+		return;
+	}
+	pthread_mutex_lock(&g.jobmutex);
+	for (int i = 0; i < n; ++i) {
+		jobs[i]->batch = &batch;
+		jobs[i]->next = NULL;
+		if (g.jobstail) {
+			g.jobstail->next = jobs[i];
+		} else {
+			g.jobs = jobs[i];
 		}
+		g.jobstail = jobs[i];
+	}
+	pthread_cond_broadcast(&g.jobcond);
+	while (batch.pending) {
+		struct job **p = &g.jobs, *prev = NULL;
+		for (; *p && (*p)->batch != &batch; prev = *p, p = &(*p)->next);
+		if (!*p) {
+			pthread_cond_wait(&g.batchcond, &g.jobmutex);
+			continue;
+		}
+		struct job *job = *p;
+		*p = job->next;
+		if (g.jobstail == job) g.jobstail = prev;
+		pthread_mutex_unlock(&g.jobmutex);
+		job->fn(job);
+		pthread_mutex_lock(&g.jobmutex);
+		--batch.pending;
+	}
+	pthread_mutex_unlock(&g.jobmutex);
+}
+
+void
+jobs_start(int n)
+{
+	g.workers = calloc(n, sizeof(pthread_t));
+	for (g.nworkers = 0; g.nworkers < n; ++g.nworkers) {
+		if (pthread_create(&g.workers[g.nworkers], NULL, worker_main, NULL) != 0) break;
+	}
+	if (g.nworkers == 0) {
+		// Without threads the jobs are just done right away
+		g.jobssync = 1;
+		struct job *job;
+		while ((job = g.jobs)) {
+			g.jobs = job->next;
+			job_submit(job);
+		}
+		g.jobstail = NULL;
+	}
+}
+
+void
+jobs_stop()
+{
+	pthread_mutex_lock(&g.jobmutex);
+	g.jobsstopped = 1;
+	// Queued jobs are cancelled and only finished, except for the ones of a batch
+	// which its waiting thread will still do
+	struct job **p = &g.jobs;
+	g.jobstail = NULL;
+	while (*p) {
+		struct job *job = *p;
+		if (job->batch) {
+			g.jobstail = job;
+			p = &job->next;
+			continue;
+		}
+		*p = job->next;
+		job->next = g.donejobs;
+		g.donejobs = job;
+	}
+	pthread_cond_broadcast(&g.jobcond);
+	pthread_mutex_unlock(&g.jobmutex);
+	for (int i = 0; g.workers && i < g.nworkers; ++i) {
+		pthread_join(g.workers[i], NULL);
+	}
+	free(g.workers);
+	g.workers = NULL;
+	g.nworkers = 0;
+	jobs_reap();
+}
+
+void
+jobs_wake()
+{
+	write(g.wakefd[1], "", 1);
+}
+
+void
+loadjob_rows(struct loadjob *lj, int pass, int rows)
+{
+	pthread_mutex_lock(&g.jobmutex);
+	lj->pass = pass;
+	lj->rows = rows;
+	pthread_mutex_unlock(&g.jobmutex);
+	jobs_wake();
+}
+
+int
+main_loop()
+{
+	struct ncinput ni;
+	struct pollfd fds[2] = {
+		{ .fd = notcurses_inputready_fd(g.nc), .events = POLLIN },
+		{ .fd = g.wakefd[0], .events = POLLIN },
+	};
+	while (1) {
+		if (nctabbed_selected(g.tabbed)) {
+			nctabbed_ensure_selected_header_visible(g.tabbed);
+			nctabbed_redraw(g.tabbed);
+		}
+		notcurses_render(g.nc);
+		tiles_evict();
+		__atomic_add_fetch(&g.tileclock, 1, __ATOMIC_RELAXED);
+		// Sleep until there is input or a job is done, which may need redrawing too
+		if (!input_pending(&ni)) {
+			poll(fds, 2, -1);
+			jobs_reap();
+			if (nctabbed_tabcount(g.tabbed) == 0 && g.loading == 0) return -1;
+			continue;
+		}
+		// Apply all input that piled up while rendering before rendering again, but
+		// only for one frame's worth of time so a flood of events can't stall the screen
+		struct timespec start, now;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		do {
+			if (handle_input(&ni)) return 0;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			long elapsed = (now.tv_sec - start.tv_sec) * 1000000000L + (now.tv_nsec - start.tv_nsec);
+			if (elapsed >= FRAME_BUDGET_NS) break;
+		} while (input_pending(&ni));
 	}
 }
 
@@ -389,26 +2540,828 @@ message(const char *msg)
 	g.message = strdup(msg);
 }
 
+int
+mip_build(struct editor *ed, int level)
+{
+	// The mips count towards the memory the tiles may take, so the tiles make room
+	// for them, unless they would take all of it themselves
+	for (int i = 0; i < level; ++i) {
+		struct mipmap *m = &ed->mips[i];
+		if (m->data) continue;
+		int w = ((i ? ed->mips[i - 1].w : ed->img.w) + 1) / 2;
+		int h = ((i ? ed->mips[i - 1].h : ed->img.h) + 1) / 2;
+		size_t size = (size_t) w * h * sizeof(struct rgba);
+		if (g.mipbytes + size > g.tilelimit || !(m->data = malloc(size))) return -1;
+		m->w = w;
+		m->h = h;
+		g.mipbytes += size;
+		// The first one reads the whole image, which may not fit in memory at once
+		for (int y = 0; y < m->h; y += TILE_SIZE / 2) {
+			mip_fill(ed, i, 0, y, m->w, y + TILE_SIZE / 2 < m->h ? y + TILE_SIZE / 2 : m->h);
+			if (i > 0) continue;
+			__atomic_add_fetch(&g.tileclock, 1, __ATOMIC_RELAXED);
+			tiles_evict();
+		}
+	}
+	return 0;
+}
+
+void
+mip_fill(struct editor *ed, int i, int x0, int y0, int x1, int y1)
+{
+	// Every pixel of a mip is the average of the (up to) 2x2 pixels below it
+	struct mipmap *src = i ? &ed->mips[i - 1] : NULL;
+	int srcw = i ? src->w : ed->img.w;
+	int srch = i ? src->h : ed->img.h;
+	struct mipmap *m = &ed->mips[i];
+	for (int y = y0; y < y1; ++y) {
+		for (int x = x0; x < x1; ++x) {
+			int r = 0, g = 0, b = 0, a = 0, n = 0;
+			for (int sy = 2*y; sy < 2*y + 2 && sy < srch; ++sy) {
+				for (int sx = 2*x; sx < 2*x + 2 && sx < srcw; ++sx) {
+					struct rgba p = src ? src->data[sx + (size_t) sy * srcw] : image_get(&ed->img, sx, sy);
+					r += p.r;
+					g += p.g;
+					b += p.b;
+					a += p.a;
+					++n;
+				}
+			}
+			m->data[x + (size_t) y * m->w] = (struct rgba) {
+				(r + n/2) / n, (g + n/2) / n, (b + n/2) / n, (a + n/2) / n
+			};
+		}
+	}
+}
+
+void
+mip_update(struct editor *ed, int x, int y, int w, int h)
+{
+	int x1 = x + w, y1 = y + h;
+	for (int i = 0; i < MAX_ZOOM_OUT && ed->mips[i].data; ++i) {
+		x /= 2;
+		y /= 2;
+		x1 = (x1 + 1) / 2;
+		y1 = (y1 + 1) / 2;
+		mip_fill(ed, i, x, y, x1, y1);
+	}
+}
+
 int
 open_file(const char *filepath)
 {
+	// Only the header is read right away, the tab then shows a placeholder until
+	// the image is decoded in the background
 	int w, h;
-	void *data = stbi_load(filepath, &w, &h, NULL, 4);
-	if (!data) return -1;
-	
+	if (!stbi_info(filepath, &w, &h, NULL) && !qoi_info(filepath, &w, &h)) return -1;
 	struct editor *ed = calloc(1, sizeof(struct editor));
+	struct loadjob *lj = calloc(1, sizeof(struct loadjob));
+	if (!ed || !lj) {
+		free(ed);
+		free(lj);
+		return -1;
+	}
 	ed->filepath = strdup(filepath);
-	ed->w = w;
-	ed->h = h;
-	ed->data = data;
+	ed->img.w = w;
+	ed->img.h = h;
+	ed->opstamp = 1;
 	ed->pricol.a = ed->seccol.a = 255;
+	ed->brushround = 1;
+	ed->brushhardness = 100;
+	ed->load = lj;
+	lj->job.fn = jobfn_load;
+	lj->job.done = donefn_load;
+	lj->filepath = strdup(filepath);
+	lj->ed = ed;
+	pthread_mutex_init(&lj->lock, NULL);
 	
-	struct nctab *tab = nctabbed_add(g.tabbed, NULL, NULL, tab_callback, filepath, ed);
-	nctabbed_select(g.tabbed, tab);
+	// New tabs go after the others, and only the first one is selected
+	struct nctab *last = nctabbed_leftmost(g.tabbed);
+	if (last) last = nctab_prev(last);
+	lj->tab = nctabbed_add(g.tabbed, last, NULL, tab_callback, filepath, ed);
+	if (nctabbed_tabcount(g.tabbed) == 1) nctabbed_select(g.tabbed, lj->tab);
 	
+	++g.loading;
+	job_submit(&lj->job);
+	return 0;
+}
+
+long
+option_num(const char *arg, long min, long max)
+{
+	// Returns -1 if arg is missing or isn't a whole number from min to max
+	if (!arg) return -1;
+	char *end;
+	long n = strtol(arg, &end, 10);
+	if (end == arg || *end || n < min || n > max) return -1;
+	return n;
+}
+
+int
+png_chunk(FILE *f, const char *type, const unsigned char *data, size_t len, const uint32_t *crc)
+{
+	// crc, if given, is the not yet inverted CRC of the type and data
+	unsigned char head[8] = { len >> 24, len >> 16, len >> 8, len };
+	memcpy(head + 4, type, 4);
+	uint32_t c = ~(crc ? *crc : crc32_update(crc32_update(~0u, head + 4, 4), data, len));
+	unsigned char tail[4] = { c >> 24, c >> 16, c >> 8, c };
+	return fwrite(head, 1, 8, f) == 8 && (!len || fwrite(data, 1, len, f) == len) && fwrite(tail, 1, 4, f) == 4 ? 0 : -1;
+}
+
+void
+png_filter(const unsigned char *cur, const unsigned char *prev, int n, int level, unsigned char *out, unsigned char *tmp)
+{
+	// Writes the filter type and the filtered row to out, picking the filter whose
+	// output has the smallest sum of absolute (signed) values, a good guess for what
+	// compresses best. Level 0 doesn't compress, so there's no point in filtering.
+	// The 4 bytes before cur and prev must be zero, and tmp must fit 4 rows.
+	int best = 0;
+	if (level > 0) {
+		long sums[5] = {};
+		g.pngfilterfn(cur, prev, 0, n, tmp, sums);
+		for (int type = 1; type <= 4; ++type) {
+			if (sums[type] < sums[best]) best = type;
+		}
+	}
+	out[0] = best;
+	memcpy(out + 1, best ? tmp + (size_t) (best - 1) * n : cur, n);
+}
+
+void
+png_filter_scalar(const unsigned char *cur, const unsigned char *prev, int i, int n, unsigned char *tmp, long *sums)
+{
+	for (; i < n; ++i) {
+		int a = cur[i - 4], b = prev[i], c = prev[i - 4];
+		unsigned char f[4] = { cur[i] - a, cur[i] - b, cur[i] - (a + b) / 2, cur[i] - png_paeth(a, b, c) };
+		sums[0] += abs((int8_t) cur[i]);
+		for (int t = 0; t < 4; ++t) {
+			tmp[i + (size_t) t * n] = f[t];
+			sums[t + 1] += abs((int8_t) f[t]);
+		}
+	}
+}
+
+#ifdef SIMD_X86
+void
+png_filter_sse2(const unsigned char *cur, const unsigned char *prev, int i, int n, unsigned char *tmp, long *sums)
+{
+	// The Paeth predictor needs 16 bits, so it's done in two halves
+	__m128i z = _mm_setzero_si128(), one = _mm_set1_epi8(1);
+	__m128i acc[5] = { z, z, z, z, z };
+	for (; i + 16 <= n; i += 16) {
+		__m128i x = _mm_loadu_si128((const __m128i *) (cur + i));
+		__m128i a = _mm_loadu_si128((const __m128i *) (cur + i - 4));
+		__m128i b = _mm_loadu_si128((const __m128i *) (prev + i));
+		__m128i c = _mm_loadu_si128((const __m128i *) (prev + i - 4));
+		__m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+		__m128i paeth[2];
+		for (int h = 0; h < 2; ++h) {
+			__m128i a16 = h ? _mm_unpackhi_epi8(a, z) : _mm_unpacklo_epi8(a, z);
+			__m128i b16 = h ? _mm_unpackhi_epi8(b, z) : _mm_unpacklo_epi8(b, z);
+			__m128i c16 = h ? _mm_unpackhi_epi8(c, z) : _mm_unpacklo_epi8(c, z);
+			__m128i bc = _mm_sub_epi16(b16, c16), ac = _mm_sub_epi16(a16, c16), abc = _mm_add_epi16(bc, ac);
+			__m128i pa = _mm_max_epi16(bc, _mm_sub_epi16(z, bc));
+			__m128i pb = _mm_max_epi16(ac, _mm_sub_epi16(z, ac));
+			__m128i pc = _mm_max_epi16(abc, _mm_sub_epi16(z, abc));
+			__m128i nota = _mm_or_si128(_mm_cmpgt_epi16(pa, pb), _mm_cmpgt_epi16(pa, pc));
+			__m128i notb = _mm_cmpgt_epi16(pb, pc);
+			__m128i bsel = _mm_or_si128(_mm_and_si128(notb, c16), _mm_andnot_si128(notb, b16));
+			paeth[h] = _mm_or_si128(_mm_and_si128(nota, bsel), _mm_andnot_si128(nota, a16));
+		}
+		__m128i f[5] = {
+			x,
+			_mm_sub_epi8(x, a),
+			_mm_sub_epi8(x, b),
+			_mm_sub_epi8(x, avg),
+			_mm_sub_epi8(x, _mm_packus_epi16(paeth[0], paeth[1])),
+		};
+		for (int t = 0; t < 5; ++t) {
+			if (t) _mm_storeu_si128((__m128i *) (tmp + i + (size_t) (t - 1) * n), f[t]);
+			__m128i abs8 = _mm_min_epu8(f[t], _mm_sub_epi8(z, f[t]));
+			acc[t] = _mm_add_epi64(acc[t], _mm_sad_epu8(abs8, z));
+		}
+	}
+	for (int t = 0; t < 5; ++t) {
+		sums[t] += _mm_cvtsi128_si64(acc[t]) + _mm_cvtsi128_si64(_mm_unpackhi_epi64(acc[t], acc[t]));
+	}
+	png_filter_scalar(cur, prev, i, n, tmp, sums);
+}
+
+__attribute__((target("avx2"))) void
+png_filter_avx2(const unsigned char *cur, const unsigned char *prev, int i, int n, unsigned char *tmp, long *sums)
+{
+	// Same as png_filter_sse2, the unpacking and packing staying within 128 bit lanes
+	__m256i z = _mm256_setzero_si256(), one = _mm256_set1_epi8(1);
+	__m256i acc[5] = { z, z, z, z, z };
+	for (; i + 32 <= n; i += 32) {
+		__m256i x = _mm256_loadu_si256((const __m256i *) (cur + i));
+		__m256i a = _mm256_loadu_si256((const __m256i *) (cur + i - 4));
+		__m256i b = _mm256_loadu_si256((const __m256i *) (prev + i));
+		__m256i c = _mm256_loadu_si256((const __m256i *) (prev + i - 4));
+		__m256i avg = _mm256_sub_epi8(_mm256_avg_epu8(a, b), _mm256_and_si256(_mm256_xor_si256(a, b), one));
+		__m256i paeth[2];
+		for (int h = 0; h < 2; ++h) {
+			__m256i a16 = h ? _mm256_unpackhi_epi8(a, z) : _mm256_unpacklo_epi8(a, z);
+			__m256i b16 = h ? _mm256_unpackhi_epi8(b, z) : _mm256_unpacklo_epi8(b, z);
+			__m256i c16 = h ? _mm256_unpackhi_epi8(c, z) : _mm256_unpacklo_epi8(c, z);
+			__m256i bc = _mm256_sub_epi16(b16, c16), ac = _mm256_sub_epi16(a16, c16), abc = _mm256_add_epi16(bc, ac);
+			__m256i pa = _mm256_abs_epi16(bc), pb = _mm256_abs_epi16(ac), pc = _mm256_abs_epi16(abc);
+			__m256i nota = _mm256_or_si256(_mm256_cmpgt_epi16(pa, pb), _mm256_cmpgt_epi16(pa, pc));
+			__m256i notb = _mm256_cmpgt_epi16(pb, pc);
+			paeth[h] = _mm256_blendv_epi8(a16, _mm256_blendv_epi8(b16, c16, notb), nota);
+		}
+		__m256i f[5] = {
+			x,
+			_mm256_sub_epi8(x, a),
+			_mm256_sub_epi8(x, b),
+			_mm256_sub_epi8(x, avg),
+			_mm256_sub_epi8(x, _mm256_packus_epi16(paeth[0], paeth[1])),
+		};
+		for (int t = 0; t < 5; ++t) {
+			if (t) _mm256_storeu_si256((__m256i *) (tmp + i + (size_t) (t - 1) * n), f[t]);
+			acc[t] = _mm256_add_epi64(acc[t], _mm256_sad_epu8(_mm256_abs_epi8(f[t]), z));
+		}
+	}
+	for (int t = 0; t < 5; ++t) {
+		__m128i s = _mm_add_epi64(_mm256_castsi256_si128(acc[t]), _mm256_extracti128_si256(acc[t], 1));
+		sums[t] += _mm_cvtsi128_si64(s) + _mm_cvtsi128_si64(_mm_unpackhi_epi64(s, s));
+	}
+	png_filter_sse2(cur, prev, i, n, tmp, sums);
+}
+#endif
+
+int
+png_load(const char *filepath, struct image *img, struct loadjob *lj)
+{
+	// Decodes 8 bit PNGs a block of compressed data at a time, so that the rows
+	// done so far can be shown. Anything else is left to stb_image by returning
+	// -1, which only happens before img is set up. Data broken later on leaves
+	// the rest of the image blank, and 1 is returned if the stream ended early or
+	// doesn't match its checksum.
+	static const unsigned char sig[8] = { 137, 'P', 'N', 'G', '\r', '\n', 26, '\n' };
+	// Where each interlacing pass starts, how far apart its pixels are and how
+	// big a block each of them fills until later passes fill in the rest
+	static const int adam7[7][6] = {
+		{ 0, 0, 8, 8, 8, 8 }, { 4, 0, 8, 8, 4, 8 }, { 0, 4, 4, 8, 4, 4 }, { 2, 0, 4, 4, 2, 4 },
+		{ 0, 2, 2, 4, 2, 2 }, { 1, 0, 2, 2, 1, 2 }, { 0, 1, 1, 2, 1, 1 },
+	};
+	static const int single[1][6] = { { 0, 0, 1, 1, 1, 1 } };
+	// The whole file is only read once the header says it can be decoded here
+	unsigned char head[8 + 25];
+	FILE *f = fopen(filepath, "rb");
+	if (!f) return -1;
+	size_t headlen = fread(head, 1, sizeof(head), f);
+	fclose(f);
+	if (headlen < sizeof(head) || memcmp(head, sig, 8) != 0 || memcmp(head + 12, "IHDR", 4) != 0) return -1;
+	#define BE32(p) ((uint32_t) (p)[0] << 24 | (p)[1] << 16 | (p)[2] << 8 | (p)[3])
+	long w = BE32(head + 16), h = BE32(head + 20);
+	int depth = head[24], type = head[25], interlace = head[28];
+	int ok = w > 0 && h > 0 && w <= 400000000 / h && depth == 8 && head[26] == 0 && head[27] == 0 && interlace <= 1;
+	ok = ok && (type == 0 || type == 2 || type == 3 || type == 4 || type == 6);
+	long len;
+	unsigned char *data = ok ? read_file(filepath, &len) : NULL;
+	if (!data || len < (long) sizeof(head)) {
+		free(data);
+		return -1;
+	}
+	// All IDAT chunks together make up the zlib stream
+	unsigned char *idat = malloc(len);
+	size_t idatlen = 0;
+	struct rgba palette[256];
+	int npalette = 0;
+	for (unsigned char *p = data + 8; ok && data + len - p >= 12;) {
+		uint32_t n = BE32(p);
+		if (n > (uint32_t) (data + len - p - 12)) break;
+		unsigned char *chunk = p + 8;
+		if (memcmp(p + 4, "PLTE", 4) == 0) {
+			npalette = n / 3 < 256 ? n / 3 : 256;
+			for (int i = 0; i < npalette; ++i) {
+				palette[i] = (struct rgba) { chunk[3*i], chunk[3*i + 1], chunk[3*i + 2], 255 };
+			}
+		} else if (memcmp(p + 4, "tRNS", 4) == 0) {
+			// A transparent colour for images without alpha is left to stb_image
+			if (type != 3) ok = 0;
+			for (uint32_t i = 0; i < n && i < (uint32_t) npalette; ++i) palette[i].a = chunk[i];
+		} else if (memcmp(p + 4, "IDAT", 4) == 0 && idat) {
+			memcpy(idat + idatlen, chunk, n);
+			idatlen += n;
+		} else if (memcmp(p + 4, "IEND", 4) == 0) {
+			break;
+		}
+		p += 12 + n;
+	}
+	#undef BE32
+	free(data);
+	if (type == 3 && !npalette) ok = 0;
+	int channels = type == 2 ? 3 : type == 4 ? 2 : type == 6 ? 4 : 1;
+	const int (*passes)[6] = interlace ? adam7 : single;
+	int npasses = interlace ? 7 : 1;
+	size_t rawlen = 0;
+	for (int i = 0; ok && i < npasses; ++i) {
+		size_t pw = (w - passes[i][0] + passes[i][2] - 1) / passes[i][2];
+		size_t ph = (h - passes[i][1] + passes[i][3] - 1) / passes[i][3];
+		if (pw && ph) rawlen += ph * (1 + pw * channels);
+	}
+	struct inflate *s = malloc(sizeof(struct inflate));
+	// Rows are unfiltered into a copy, since later data refers back to the filtered bytes
+	unsigned char *raw = ok ? malloc(rawlen) : NULL, *rows = calloc(2, w * channels);
+	struct rgba *line = malloc(w * sizeof(struct rgba));
+	ok = ok && idat && idatlen >= 2 && s && raw && rows && line;
+	// A zlib header for deflate without a preset dictionary
+	ok = ok && (idat[0] & 0x0F) == 8 && (idat[0] << 8 | idat[1]) % 31 == 0 && !(idat[1] & 0x20);
+	if (!ok || image_alloc(img, w, h) < 0) {
+		free(idat);
+		free(s);
+		free(raw);
+		free(rows);
+		free(line);
+		return -1;
+	}
+	*s = (struct inflate) { .in = idat + 2, .end = idat + idatlen, .out = raw, .cap = rawlen };
+	unsigned char *prev = rows, *cur = rows + w * channels;
+	int pass = 0, y = 0, shownpass = 0, shownrows = 0;
+	size_t off = 0; // of row y of the pass in raw
+	int damaged = 1;
+	while (!s->final && inflate_block(s) == 0) {
+		// Unfilter and show the rows that are complete now
+		while (pass < npasses) {
+			const int *ps = passes[pass];
+			int pw = (w - ps[0] + ps[2] - 1) / ps[2], ph = (h - ps[1] + ps[3] - 1) / ps[3];
+			size_t stride = 1 + (size_t) pw * channels;
+			if (!pw || y == ph) {
+				++pass;
+				y = 0;
+				memset(prev, 0, w * channels);
+				continue;
+			}
+			if (s->len - off < stride) break;
+			memcpy(cur, raw + off + 1, stride - 1);
+			if (png_unfilter(cur, prev, stride - 1, channels, raw[off]) < 0) goto done;
+			for (int i = 0; i < pw; ++i) {
+				const unsigned char *c = cur + i * channels;
+				switch (type) {
+				case 0: {
+					line[i] = (struct rgba) { c[0], c[0], c[0], 255 };
+				} break;
+				case 2: {
+					line[i] = (struct rgba) { c[0], c[1], c[2], 255 };
+				} break;
+				case 3: {
+					line[i] = c[0] < npalette ? palette[c[0]] : (struct rgba) { 0, 0, 0, 255 };
+				} break;
+				case 4: {
+					line[i] = (struct rgba) { c[0], c[0], c[0], c[1] };
+				} break;
+				case 6: {
+					line[i] = (struct rgba) { c[0], c[1], c[2], c[3] };
+				} break;
+				}
+			}
+			// Later passes change rows that may be on screen already
+			if (lj && pass) pthread_mutex_lock(&lj->lock);
+			int y0 = ps[1] + y * ps[3];
+			for (int yy = y0; yy < y0 + ps[5] && yy < h; ++yy) {
+				if (ps[2] == 1) {
+					for (int x = 0, n; x < w; x += n) {
+						struct rgba *dst = image_row(img, x, yy, &n);
+						memcpy(dst, &line[x], n * sizeof(struct rgba));
+					}
+					continue;
+				}
+				for (int i = 0; i < pw; ++i) {
+					for (int x = ps[0] + i * ps[2], n; x < ps[0] + i * ps[2] + ps[4] && x < w; ++x) {
+						*image_row(img, x, yy, &n) = line[i];
+					}
+				}
+			}
+			if (lj && pass) pthread_mutex_unlock(&lj->lock);
+			unsigned char *t = prev;
+			prev = cur;
+			cur = t;
+			off += stride;
+			++y;
+		}
+		int rows = pass < npasses && y ? passes[pass][1] + (y - 1) * passes[pass][3] + passes[pass][5] : 0;
+		if (rows > h) rows = h;
+		if (lj && (pass != shownpass || rows != shownrows)) loadjob_rows(lj, pass, rows);
+		shownpass = pass;
+		shownrows = rows;
+	}
+	if (s->final && pass == npasses) {
+		// The stream ends with the Adler-32 of what it holds, big endian
+		inflate_get(s, s->nbits & 7);
+		uint32_t adler = 0;
+		for (int i = 0; i < 4; ++i) adler = adler << 8 | inflate_get(s, 8);
+		damaged = s->pad * 8 > s->nbits || adler != adler32(1, raw, s->len);
+	}
+done:
+	free(idat);
+	free(s);
+	free(raw);
+	free(rows);
+	free(line);
+	return damaged;
+}
+
+int
+png_paeth(int a, int b, int c)
+{
+	int p = a + b - c;
+	int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+	if (pa <= pb && pa <= pc) return a;
+	return pb <= pc ? b : c;
+}
+
+int
+png_unfilter(unsigned char *row, const unsigned char *prev, int n, int bpp, int type)
+{
+	// Undoes the filter of the given type in place, prev being the row above
+	switch (type) {
+	case 1: {
+		for (int i = bpp; i < n; ++i) row[i] += row[i - bpp];
+	} break;
+	case 2: {
+		for (int i = 0; i < n; ++i) row[i] += prev[i];
+	} break;
+	case 3: {
+		for (int i = 0; i < bpp; ++i) row[i] += prev[i] >> 1;
+		for (int i = bpp; i < n; ++i) row[i] += (row[i - bpp] + prev[i]) >> 1;
+	} break;
+	case 4: {
+		for (int i = 0; i < bpp; ++i) row[i] += prev[i];
+		for (int i = bpp; i < n; ++i) row[i] += png_paeth(row[i - bpp], prev[i], prev[i - bpp]);
+	} break;
+	default: {
+		// The only other valid filter is none
+		if (type != 0) return -1;
+	} break;
+	}
+	return 0;
+}
+
+int
+qoi_info(const char *filepath, int *w, int *h)
+{
+	// Like stbi_info, for the QOI images stb_image doesn't know
+	FILE *f = fopen(filepath, "rb");
+	if (!f) return 0;
+	unsigned char head[14];
+	int ok = fread(head, 1, 14, f) == 14 && memcmp(head, "qoif", 4) == 0;
+	fclose(f);
+	if (!ok) return 0;
+	uint32_t qw = (uint32_t) head[4] << 24 | head[5] << 16 | head[6] << 8 | head[7];
+	uint32_t qh = (uint32_t) head[8] << 24 | head[9] << 16 | head[10] << 8 | head[11];
+	if (qw == 0 || qh == 0 || qw > 400000000 / qh) return 0;
+	*w = qw;
+	*h = qh;
+	return 1;
+}
+
+int
+qoi_load(const char *filepath, struct image *img, struct loadjob *lj)
+{
+	// The file is read and the tiles are allocated as the rows are reached, so
+	// that the first ones can be shown before the rest of the file is looked at
+	int w, h;
+	if (!qoi_info(filepath, &w, &h)) return -1;
+	FILE *f = fopen(filepath, "rb");
+	unsigned char *buf = malloc(QOI_BUFFER);
+	if (!f || !buf || fseek(f, 14, SEEK_SET) != 0 || image_init(img, w, h) < 0) {
+		if (f) fclose(f);
+		free(buf);
+		return -1;
+	}
+	struct rgba px = { 0, 0, 0, 255 }, index[64] = {};
+	unsigned char *p = buf, *end = buf;
+	int run = 0, eof = 0, damaged = 0;
+	for (int y = 0; y < h; ++y) {
+		if (!(y & TILE_MASK) && image_alloc_row(img, y >> TILE_SHIFT) < 0) {
+			// The rows decoded so far may be shown already, so the tiles are left to
+			// be freed with the job
+			fclose(f);
+			free(buf);
+			return -1;
+		}
+		for (int x = 0, n; x < w && !damaged; x += n) {
+			struct rgba *row = image_row(img, x, y, &n);
+			for (int i = 0; i < n; ++i) {
+				if (run > 0) {
+					--run;
+					row[i] = px;
+					continue;
+				}
+				if (end - p < 5 && !eof) {
+					// Keep a whole chunk in the buffer, the longest is 5 bytes
+					memmove(buf, p, end - p);
+					end = buf + (end - p);
+					p = buf;
+					size_t got = fread(end, 1, QOI_BUFFER - (end - buf), f);
+					end += got;
+					eof = got == 0;
+				}
+				int b = p < end ? *p++ : -1, left = end - p;
+				if (b < 0 || (b == 0xFE && left < 3) || (b == 0xFF && left < 4) || (b >> 6 == 2 && left < 1)) {
+					// The file ends in the middle of a chunk, so the rest of the image is
+					// left blank
+					damaged = 1;
+					break;
+				}
+				if (b == 0xFE) {
+					px.r = p[0];
+					px.g = p[1];
+					px.b = p[2];
+					p += 3;
+				} else if (b == 0xFF) {
+					px = (struct rgba) { p[0], p[1], p[2], p[3] };
+					p += 4;
+				} else if (b >> 6 == 0) {
+					px = index[b];
+				} else if (b >> 6 == 1) {
+					px.r += (b >> 4 & 3) - 2;
+					px.g += (b >> 2 & 3) - 2;
+					px.b += (b & 3) - 2;
+				} else if (b >> 6 == 2) {
+					int dg = (b & 0x3F) - 32, d = *p++;
+					px.r += dg - 8 + (d >> 4);
+					px.g += dg;
+					px.b += dg - 8 + (d & 15);
+				} else {
+					run = b & 0x3F;
+				}
+				index[(px.r * 3 + px.g * 5 + px.b * 7 + px.a * 11) % 64] = px;
+				row[i] = px;
+			}
+		}
+		if (lj && ((y & TILE_MASK) == TILE_MASK || y == h - 1)) loadjob_rows(lj, 0, y + 1);
+	}
+	if (lj) lj->damaged = damaged;
+	fclose(f);
+	free(buf);
+	return 0;
+}
+
+unsigned char *
+read_file(const char *filepath, long *len)
+{
+	FILE *f = fopen(filepath, "rb");
+	if (!f) return NULL;
+	unsigned char *data = NULL;
+	if (fseek(f, 0, SEEK_END) == 0 && (*len = ftell(f)) >= 0 && fseek(f, 0, SEEK_SET) == 0) {
+		data = malloc(*len ? *len : 1);
+		if (data && fread(data, 1, *len, f) != (size_t) *len) {
+			free(data);
+			data = NULL;
+		}
+	}
+	fclose(f);
+	return data;
+}
+
+int
+redo(struct editor *ed)
+{
+	undo_commit(ed);
+	struct undo *op = ed->undo ? ed->undo->next : ed->history;
+	if (!op) return 1;
+	if (undo_unpack(ed, op) < 0 || undo_swap(ed, op) < 0) return -1;
+	ed->undo = op;
+	undo_trim(ed, op);
+	return 0;
+}
+
+struct rect
+rect_to_view(struct editor *ed, struct rect r)
+{
+	int x1 = r.x + r.w, y1 = r.y + r.h;
+	if (ed->zoom > 0) {
+		// Round outwards, a view pixel is affected by any of its image pixels
+		x1 = ((x1 - 1) >> ed->zoom) + 1;
+		y1 = ((y1 - 1) >> ed->zoom) + 1;
+	} else {
+		x1 = to_view(ed, x1);
+		y1 = to_view(ed, y1);
+	}
+	r.x = to_view(ed, r.x);
+	r.y = to_view(ed, r.y);
+	r.w = x1 - r.x;
+	r.h = y1 - r.y;
+	return r;
+}
+
+struct rect
+rect_union(struct rect a, struct rect b)
+{
+	int x1 = a.x + a.w > b.x + b.w ? a.x + a.w : b.x + b.w;
+	int y1 = a.y + a.h > b.y + b.h ? a.y + a.h : b.y + b.h;
+	a.x = a.x < b.x ? a.x : b.x;
+	a.y = a.y < b.y ? a.y : b.y;
+	a.w = x1 - a.x;
+	a.h = y1 - a.y;
+	return a;
+}
+
+int
+rgb_dist(struct rgba p, struct rgba q)
+{
+	return (p.r - q.r) * (p.r - q.r) + (p.g - q.g) * (p.g - q.g) + (p.b - q.b) * (p.b - q.b);
+}
+
+int
+scratch_put(struct tile *t)
+{
+	// Returns the slot of the scratch file the tile was written to, or -1
+	if (!g.scratch && !(g.scratch = tmpfile())) return -1;
+	if (!g.nscratchfree && g.nscratch == g.scratchcap) {
+		int cap = g.scratchcap ? g.scratchcap * 2 : 256;
+		int *refs = realloc(g.scratchrefs, cap * sizeof(int));
+		if (!refs) return -1;
+		g.scratchrefs = refs;
+		int *free = realloc(g.scratchfree, cap * sizeof(int));
+		if (!free) return -1;
+		g.scratchfree = free;
+		g.scratchcap = cap;
+	}
+	int slot = g.nscratchfree ? g.scratchfree[--g.nscratchfree] : g.nscratch++;
+	if (pwrite(fileno(g.scratch), t->px, sizeof(t->px), (off_t) slot * sizeof(t->px)) != sizeof(t->px)) {
+		g.scratchfree[g.nscratchfree++] = slot;
+		return -1;
+	}
+	g.scratchrefs[slot] = 1;
+	return slot;
+}
+
+void
+scratch_unref(int slot)
+{
+	if (--g.scratchrefs[slot] == 0) g.scratchfree[g.nscratchfree++] = slot;
+}
+
+int
+set_rendermode(enum rendermode mode)
+{
+	struct rendermodedata *rm = &RENDERMODES[mode];
+	if (mode == RENDER_PIXEL) {
+		if (notcurses_check_pixel_support(g.nc) <= 0) return -1;
+		int cdimy, cdimx;
+		ncplane_pixelgeom(g.viewplane, NULL, NULL, &cdimy, &cdimx, NULL, NULL);
+		if (cdimy <= 0 || cdimx <= 0) return -1;
+		g.blockpw = cdimx;
+		g.blockph = cdimy;
+		if (!g.pixplane) {
+			g.pixplane = ncplane_create(g.viewplane, &(struct ncplane_options) {
+				.x = 0, .y = 0,
+				.cols = g.vieww,
+				.rows = g.viewh
+			});
+		}
+	} else {
+		g.blockpw = rm->blockpw;
+		g.blockph = rm->blockph;
+		if (g.pixplane) {
+			ncplane_destroy(g.pixplane);
+			g.pixplane = NULL;
+		}
+	}
+	g.blockcw = rm->blockcw;
+	g.blockch = rm->blockch;
+	g.viewpw = g.vieww / g.blockcw * g.blockpw;
+	g.viewph = g.viewh / g.blockch * g.blockph;
+	g.render = mode;
+	g.shown = NULL;
+	return 0;
+}
+
+int
+set_zoom(struct editor *ed, int zoom)
+{
+	// Returns 1 if it's as far as zooming goes, and -1 if there's no memory for the mips
+	if (zoom < -MAX_ZOOM_IN || zoom > MAX_ZOOM_OUT) return 1;
+	// No point in shrinking past a single pixel
+	if (zoom > 0 && ed->img.w >> (zoom - 1) <= 1 && ed->img.h >> (zoom - 1) <= 1) return 1;
+	if (zoom > 0) {
+		if (mip_build(ed, zoom) < 0) return -1;
+		ed->zw = ed->mips[zoom - 1].w;
+		ed->zh = ed->mips[zoom - 1].h;
+	} else {
+		ed->zw = ed->img.w << -zoom;
+		ed->zh = ed->img.h << -zoom;
+	}
+	ed->zoom = zoom;
+	// Center the view on the cursor, starting on a whole view pixel
+	int vx = to_view(ed, ed->curx) - g.viewpw / 2;
+	int vy = to_view(ed, ed->cury) - g.viewph / 2;
+	ed->viewx = to_image(ed, vx > 0 ? vx : 0);
+	ed->viewy = to_image(ed, vy > 0 ? vy : 0);
+	return 0;
+}
+
+int
+shape_ellipse(struct editor *ed, int x0, int y0, int x1, int y1, struct rgba rgba)
+{
+	// Zingl's midpoint ellipse fitting the rectangle, which gets even sizes right
+	// too. Only the left half is traced, noting the run of it on each row, and the
+	// right half mirrors it.
+	int h = y1 - y0 + 1, mx = x0 + x1;
+	int (*runs)[2] = malloc(h * sizeof(*runs));
+	if (!runs) return -1;
+	for (int i = 0; i < h; ++i) {
+		runs[i][0] = x1;
+		runs[i][1] = x0 - 1;
+	}
+	long a = x1 - x0, b = y1 - y0, b1 = b & 1;
+	long dx = 4 * (1 - a) * b * b, dy = 4 * (b1 + 1) * a * a;
+	long err = dx + dy + b1 * a * a;
+	int x = x0, xr = x1, yb = y0 + (b + 1) / 2, yt = yb - b1;
+	a *= 8 * a;
+	b1 = 8 * b * b;
+	do {
+		int rows[2] = { yb - y0, yt - y0 };
+		for (int k = 0; k < 2; ++k) {
+			if (x < runs[rows[k]][0]) runs[rows[k]][0] = x;
+			if (x > runs[rows[k]][1]) runs[rows[k]][1] = x;
+		}
+		long e2 = 2 * err;
+		if (e2 <= dy) {
+			++yb;
+			--yt;
+			err += dy += a;
+		}
+		if (e2 >= dx || 2 * err > dy) {
+			++x;
+			--xr;
+			err += dx += b1;
+		}
+	} while (x <= xr);
+	// Very flat ellipses stop early, before reaching the ends
+	while (yb - yt < b) {
+		runs[yb - y0][0] = runs[yb - y0][1] = x - 1;
+		runs[yt - y0][0] = runs[yt - y0][1] = x - 1;
+		++yb;
+		--yt;
+	}
+	int failed = 0;
+	for (int i = 0; i < h && !failed; ++i) {
+		int l = runs[i][0], r = runs[i][1];
+		if (l > r) continue;
+		if (ed->filled || mx - r <= r + 1) {
+			failed = edit_span(ed, l, mx - l, y0 + i, rgba) < 0;
+		} else {
+			failed = edit_span(ed, l, r, y0 + i, rgba) < 0 || edit_span(ed, mx - r, mx - l, y0 + i, rgba) < 0;
+		}
+	}
+	free(runs);
+	return failed ? -1 : 0;
+}
+
+int
+shape_line(struct editor *ed, int x0, int y0, int x1, int y1, struct rgba rgba)
+{
+	// Bresenham's, with the pixels on one row written together
+	int dx = abs(x1 - x0), sx = x0 < x1 ? 1 : -1;
+	int dy = -abs(y1 - y0), sy = y0 < y1 ? 1 : -1;
+	int err = dx + dy, start = x0;
+	while (1) {
+		int x = x0, e2 = 2 * err;
+		if (x0 == x1 && y0 == y1) {
+			return edit_span(ed, start < x ? start : x, start < x ? x : start, y0, rgba);
+		}
+		if (e2 >= dy) {
+			err += dy;
+			x0 += sx;
+		}
+		if (e2 <= dx) {
+			if (edit_span(ed, start < x ? start : x, start < x ? x : start, y0, rgba) < 0) return -1;
+			err += dx;
+			y0 += sy;
+			start = x0;
+		}
+	}
+}
+
+int
+shape_rect(struct editor *ed, int x0, int y0, int x1, int y1, struct rgba rgba)
+{
+	for (int y = y0; y <= y1; ++y) {
+		if (ed->filled || y == y0 || y == y1 || x1 - x0 < 2) {
+			if (edit_span(ed, x0, x1, y, rgba) < 0) return -1;
+		} else {
+			if (edit_span(ed, x0, x0, y, rgba) < 0 || edit_span(ed, x1, x1, y, rgba) < 0) return -1;
+		}
+	}
 	return 0;
 }
 
+void
+stroke_end(struct editor *ed)
+{
+	if (!ed->strokecov) return;
+	for (int i = 0; i < ed->img.tw * ed->img.th; ++i) {
+		free(ed->strokecov[i]);
+	}
+	free(ed->strokecov);
+	ed->strokecov = NULL;
+}
+
 void
 tab_callback(struct nctab* tab, struct ncplane* ncp, void* curry)
 {
@@ -416,7 +3369,42 @@ tab_callback(struct nctab* tab, struct ncplane* ncp, void* curry)
 	struct editor *ed = curry;
 	ncplane_erase(ncp);
 	
-	ncplane_printf(ncp, " α %-3d", ed->data[ed->curx + ed->cury * ed->w].a);
+	if (ed->load) {
+		// Decode the image the user is looking at before the others
+		job_prioritize(&ed->load->job);
+		pthread_mutex_lock(&g.jobmutex);
+		int pass = ed->load->pass, rows = ed->load->rows;
+		pthread_mutex_unlock(&g.jobmutex);
+		if (!pass && !rows) {
+			ncplane_printf(ncp, " Loading %dx%d image...", ed->img.w, ed->img.h);
+			ncplane_erase(g.viewplane);
+			if (g.pixplane) ncplane_erase(g.pixplane);
+			g.shown = NULL;
+			return;
+		}
+		// The rows the decoder is done with are shown from its tiles already, keeping
+		// it from changing them in later passes while they're being drawn
+		if (!ed->loadpass && !ed->loadrows) {
+			ed->img = ed->load->img;
+			set_zoom(ed, 0);
+		}
+		if (pass != ed->loadpass) {
+			// Several small passes may have finished at once, and each one changes every row
+			damage(ed, 0, 0, ed->img.w, ed->img.h);
+		} else {
+			damage(ed, 0, ed->loadrows, ed->img.w, rows - ed->loadrows);
+		}
+		ed->loadpass = pass;
+		ed->loadrows = rows;
+		pthread_mutex_lock(&ed->load->lock);
+		if (pass) {
+			ncplane_printf(ncp, " Loading, pass %d", pass + 1);
+		} else {
+			ncplane_printf(ncp, " Loading %d%%", (int) (100L * rows / ed->img.h));
+		}
+	} else {
+		ncplane_printf(ncp, " α %-3d", image_get(&ed->img, ed->curx, ed->cury).a);
+	}
 	
 	ncplane_putstr(ncp, "   ");
 	
@@ -435,6 +3423,30 @@ tab_callback(struct nctab* tab, struct ncplane* ncp, void* curry)
 	ncplane_putstr(ncp, "   ");
 	
 	ncplane_putstr(ncp, TOOLS[ed->tool].name);
+	if (ed->tool == TOOL_DRAW) ncplane_printf(ncp, " %s r%d %d%% %s", ed->brushround ? "round" : "square", ed->brushradius, ed->brushhardness, BLENDMODES[ed->blend]);
+	if (ed->tool == TOOL_FILL) ncplane_printf(ncp, " %d-way ±%d", ed->fill8 ? 8 : 4, ed->filltolerance);
+	if (ed->tool == TOOL_RECT || ed->tool == TOOL_ELLIPSE) ncplane_putstr(ncp, ed->filled ? " filled" : " outline");
+	if (ed->anchored) ncplane_printf(ncp, " from %d,%d", ed->anchorx, ed->anchory);
+	
+	ncplane_putstr(ncp, "   ");
+	
+	if (ed->zoom >= 0) {
+		ncplane_printf(ncp, "1:%d", 1 << ed->zoom);
+	} else {
+		ncplane_printf(ncp, "%d:1", 1 << -ed->zoom);
+	}
+	
+	if (ed->save) {
+		pthread_mutex_lock(&g.jobmutex);
+		int progress = ed->save->job.progress;
+		pthread_mutex_unlock(&g.jobmutex);
+		ncplane_printf(ncp, "   Saving %d%%", progress);
+	}
+	
+	if (__atomic_load_n(&ed->img.failed, __ATOMIC_RELAXED) == 1) {
+		__atomic_store_n(&ed->img.failed, 2, __ATOMIC_RELAXED);
+		message("Part of the image couldn't be read back, so it can't be saved");
+	}
 	
 	if (g.message) {
 		ncplane_putstr_yx(
@@ -445,31 +3457,104 @@ tab_callback(struct nctab* tab, struct ncplane* ncp, void* curry)
 		free(g.message);
 		g.message = NULL;
 	}
-	
-	ncplane_erase(g.viewplane);
-	int yupto = g.viewh;
-	if (yupto > ed->h - ed->viewy) yupto = ed->h - ed->viewy;
-	int xupto = g.vieww / 2;
-	if (xupto > ed->w - ed->viewx) xupto = ed->w - ed->viewx;
-	for (int y = 0; y < yupto; ++y) {
-		for (int x = 0; x < xupto; ++x) {
-			int ix = x + ed->viewx;
-			int iy = y + ed->viewy;
-			struct rgba rgba = ed->data[ix + iy*ed->w];
-			ncplane_set_bg_rgb8(g.viewplane, rgba.r, rgba.g, rgba.b);
-			if (iy == ed->cury && ix == ed->curx) {
-				ncplane_set_fg_rgb8(g.viewplane, 255 - rgba.r, 255 - rgba.g, 255 - rgba.b);
-				ncplane_putstr_yx(g.viewplane, y, 2*x, "[]");
-				ncplane_set_fg_default(g.viewplane);
-			} else {
-				ncplane_putstr_yx(g.viewplane, y, 2*x, "  ");
-			}
+	
+	int vx = to_view(ed, ed->viewx), vy = to_view(ed, ed->viewy);
+	int dx = vx - g.shownviewx;
+	int dy = vy - g.shownviewy;
+	int curmoved = g.showncurx != ed->curx || g.showncury != ed->cury;
+	if (g.render == RENDER_PIXEL) {
+		// A bitmap is always sent whole
+		if (g.shown != ed || g.shownzoom != ed->zoom || dx || dy || curmoved || ed->ndamage) view_blit(ed);
+	} else if (
+		g.shown != ed || g.shownzoom != ed->zoom
+		|| dx % g.blockpw || dy % g.blockph
+		|| abs(dx) >= g.viewpw || abs(dy) >= g.viewph
+	) {
+		ncplane_erase(g.viewplane);
+		view_draw(ed, vx, vy, g.viewpw, g.viewph);
+	} else {
+		if (dx || dy) view_scroll(ed, dx, dy);
+		if (curmoved) {
+			damage(ed, g.showncurx, g.showncury, 1, 1);
+			damage(ed, ed->curx, ed->cury, 1, 1);
+		}
+		for (int i = 0; i < ed->ndamage; ++i) {
+			struct rect r = rect_to_view(ed, ed->damage[i]);
+			view_draw(ed, r.x, r.y, r.w, r.h);
+		}
+	}
+	ed->ndamage = 0;
+	g.shown = ed;
+	g.shownzoom = ed->zoom;
+	g.shownviewx = vx;
+	g.shownviewy = vy;
+	g.showncurx = ed->curx;
+	g.showncury = ed->cury;
+	if (ed->load) {
+		pthread_mutex_unlock(&ed->load->lock);
+		return;
+	}
+	// Zoomed out, the view is drawn from the mips instead
+	if (ed->zoom <= 0) tiles_prefetch(ed);
+}
+
+void
+toolfn_draw(struct editor *ed, struct ncinput *ni)
+{
+	// The mouse skips pixels when moved fast, so a drag stamps the brush along a
+	// line from where it last was, a few pixels apart for big brushes
+	struct rgba rgba;
+	int x0 = ed->curx, y0 = ed->cury, k = 0;
+	if (nckey_mouse_p(ni->id)) {
+		if (ni->id == NCKEY_BUTTON1) {
+			rgba = ed->pricol;
+		} else if (ni->id == NCKEY_BUTTON2 || ni->id == NCKEY_BUTTON3) {
+			rgba = ed->seccol;
+		} else {
+			return;
+		}
+		if (ed->mousedown) {
+			x0 = ed->strokex;
+			y0 = ed->strokey;
+			k = 1;
+		} else {
+			stroke_end(ed);
+			ed->strokecov = calloc(ed->img.tw * ed->img.th, sizeof(unsigned char *));
+		}
+		ed->strokex = ed->curx;
+		ed->strokey = ed->cury;
+	} else {
+		rgba = ni->id == NCKEY_ENTER ? ed->pricol : ed->seccol;
+	}
+	unsigned char *mask = brush_mask(ed);
+	if (!mask) {
+		message("Drawing failed");
+		return;
+	}
+	int r = ed->brushradius, dx = ed->curx - x0, dy = ed->cury - y0;
+	int len = abs(dx) > abs(dy) ? abs(dx) : abs(dy), n = (len + r / 8) / (1 + r / 8);
+	if (n < 1) n = 1;
+	for (; k <= n; ++k) {
+		if (brush_stamp(ed, mask, x0 + (int) lroundf((float) dx * k / n), y0 + (int) lroundf((float) dy * k / n), rgba) < 0) {
+			message("Drawing failed");
+			break;
 		}
 	}
+	int x = (x0 < ed->curx ? x0 : ed->curx) - r, y = (y0 < ed->cury ? y0 : ed->cury) - r;
+	int w = abs(dx) + 2 * r + 1, h = abs(dy) + 2 * r + 1;
+	if (x < 0) {
+		w += x;
+		x = 0;
+	}
+	if (y < 0) {
+		h += y;
+		y = 0;
+	}
+	image_changed(ed, x, y, w, h);
 }
 
 void
-toolfn_draw(struct editor *ed, struct ncinput *ni)
+toolfn_pipette(struct editor *ed, struct ncinput *ni)
 {
 	if (nckey_mouse_p(ni->id)) {
 		if (ni->id == NCKEY_BUTTON1) {
@@ -486,17 +3571,20 @@ toolfn_draw(struct editor *ed, struct ncinput *ni)
 	}
 	return;
 prim:
-	ed->data[ed->curx + ed->cury * ed->w] = ed->pricol;
+	ed->pricol = image_get(&ed->img, ed->curx, ed->cury);
 	return;
 sec:
-	ed->data[ed->curx + ed->cury * ed->w] = ed->seccol;
+	ed->seccol = image_get(&ed->img, ed->curx, ed->cury);
 }
 
 void
-toolfn_pipette(struct editor *ed, struct ncinput *ni)
+toolfn_fill(struct editor *ed, struct ncinput *ni)
 {
 	if (nckey_mouse_p(ni->id)) {
-		if (ni->id == NCKEY_BUTTON1) {
+		// Filling again with every move of a drag would only be slow
+		if (ed->mousedown) {
+			return;
+		} else if (ni->id == NCKEY_BUTTON1) {
 			goto prim;
 		} else if (ni->id == NCKEY_BUTTON2 || ni->id == NCKEY_BUTTON3) {
 			goto sec;
@@ -510,30 +3598,958 @@ toolfn_pipette(struct editor *ed, struct ncinput *ni)
 	}
 	return;
 prim:
-	ed->pricol = ed->data[ed->curx + ed->cury * ed->w];
+	flood_fill(ed, ed->curx, ed->cury, ed->pricol);
 	return;
 sec:
-	ed->seccol = ed->data[ed->curx + ed->cury * ed->w];
+	flood_fill(ed, ed->curx, ed->cury, ed->seccol);
+}
+
+void
+toolfn_shape(struct editor *ed, struct ncinput *ni)
+{
+	// The first press chooses one end or corner and the second draws the shape to
+	// the other. Dragging with a button held doesn't count as pressing again.
+	struct rgba rgba;
+	if (nckey_mouse_p(ni->id)) {
+		if (ed->mousedown) {
+			return;
+		} else if (ni->id == NCKEY_BUTTON1) {
+			rgba = ed->pricol;
+		} else if (ni->id == NCKEY_BUTTON2 || ni->id == NCKEY_BUTTON3) {
+			rgba = ed->seccol;
+		} else {
+			return;
+		}
+	} else {
+		rgba = ni->id == NCKEY_ENTER ? ed->pricol : ed->seccol;
+	}
+	if (!ed->anchored) {
+		ed->anchored = 1;
+		ed->anchorx = ed->curx;
+		ed->anchory = ed->cury;
+		return;
+	}
+	ed->anchored = 0;
+	int x0 = ed->anchorx < ed->curx ? ed->anchorx : ed->curx, x1 = ed->anchorx + ed->curx - x0;
+	int y0 = ed->anchory < ed->cury ? ed->anchory : ed->cury, y1 = ed->anchory + ed->cury - y0;
+	int r;
+	if (ed->tool == TOOL_LINE) {
+		r = shape_line(ed, ed->anchorx, ed->anchory, ed->curx, ed->cury, rgba);
+	} else if (ed->tool == TOOL_RECT) {
+		r = shape_rect(ed, x0, y0, x1, y1, rgba);
+	} else {
+		r = shape_ellipse(ed, x0, y0, x1, y1, rgba);
+	}
+	// What was drawn before running out of memory stays, to be undone together
+	if (r < 0) message("Drawing failed");
+	image_changed(ed, x0, y0, x1 - x0 + 1, y1 - y0 + 1);
+}
+
+struct tile *
+tile_dup(struct tile *t)
+{
+	struct tile *copy = malloc(sizeof(struct tile));
+	if (!copy) return NULL;
+	memcpy(copy->px, t->px, sizeof(t->px));
+	copy->refs = 1;
+	return copy;
+}
+
+void
+tile_unref(struct tile *t)
+{
+	if (t && --t->refs == 0) free(t);
+}
+
+int
+tileref_cmp(const void *a, const void *b)
+{
+	unsigned ua = ((const struct tileref *) a)->used, ub = ((const struct tileref *) b)->used;
+	return (ua > ub) - (ua < ub);
+}
+
+void
+tiles_evict()
+{
+	// Counts the tiles only held by the images of tabs, and if there are too many,
+	// drops the least recently used ones that weren't needed for this frame. Images
+	// still being decoded have no used stamps yet and are left alone until done.
+	struct nctab *first = nctabbed_selected(g.tabbed), *tab = first;
+	if (!first) return;
+	size_t n = 0, limit = (g.tilelimit - g.mipbytes) / sizeof(struct tile);
+	do {
+		struct image *img = &((struct editor *) nctab_userptr(tab))->img;
+		for (int i = 0; img->used && i < img->tw * img->th; ++i) {
+			if (img->tiles[i] && img->tiles[i]->refs == 1) ++n;
+		}
+	} while ((tab = nctab_next(tab)) != first);
+	if (n <= limit) return;
+	struct tileref *refs = malloc(n * sizeof(struct tileref));
+	if (!refs) return;
+	size_t nrefs = 0;
+	do {
+		struct image *img = &((struct editor *) nctab_userptr(tab))->img;
+		for (int i = 0; img->used && i < img->tw * img->th; ++i) {
+			unsigned used = __atomic_load_n(&img->used[i], __ATOMIC_RELAXED);
+			if (!img->tiles[i] || img->tiles[i]->refs != 1 || used == g.tileclock) continue;
+			refs[nrefs++] = (struct tileref) { used, img, i };
+		}
+	} while ((tab = nctab_next(tab)) != first);
+	qsort(refs, nrefs, sizeof(struct tileref), tileref_cmp);
+	for (size_t k = 0; k < nrefs && n > limit; ++k, --n) {
+		struct image *img = refs[k].img;
+		int i = refs[k].i;
+		if (!img->slots) {
+			if (!(img->slots = malloc(img->tw * img->th * sizeof(int)))) break;
+			for (int j = 0; j < img->tw * img->th; ++j) img->slots[j] = -1;
+		}
+		// Clean tiles of a mapped file can be read from it again
+		int clean = img->slots[i] >= 0 || (img->map && !img->dirty[i]);
+		if (!clean && (img->slots[i] = scratch_put(img->tiles[i])) < 0) break;
+		tile_unref(img->tiles[i]);
+		img->tiles[i] = NULL;
+	}
+	free(refs);
+}
+
+void
+tiles_prefetch(struct editor *ed)
+{
+	// Has the tiles around the view that aren't in memory read ahead from disk, so
+	// scrolling there doesn't wait for them, and keeps the ones that are from being dropped
+	struct image *img = &ed->img;
+	int tx0 = (ed->viewx >> TILE_SHIFT) - 1, tx1 = ((ed->viewx + to_image(ed, g.viewpw)) >> TILE_SHIFT) + 1;
+	int ty0 = (ed->viewy >> TILE_SHIFT) - 1, ty1 = ((ed->viewy + to_image(ed, g.viewph)) >> TILE_SHIFT) + 1;
+	if (tx0 < 0) tx0 = 0;
+	if (ty0 < 0) ty0 = 0;
+	if (tx1 >= img->tw) tx1 = img->tw - 1;
+	if (ty1 >= img->th) ty1 = img->th - 1;
+	uintptr_t pagemask = sysconf(_SC_PAGESIZE) - 1;
+	for (int ty = ty0; ty <= ty1; ++ty) {
+		for (int tx = tx0; tx <= tx1; ++tx) {
+			int i = tx + ty * img->tw;
+			__atomic_store_n(&img->used[i], g.tileclock, __ATOMIC_RELAXED);
+			if (img->tiles[i]) continue;
+			if (img->slots && img->slots[i] >= 0) {
+				size_t len = TILE_SIZE * TILE_SIZE * sizeof(struct rgba);
+				posix_fadvise(fileno(g.scratch), (off_t) img->slots[i] * len, len, POSIX_FADV_WILLNEED);
+				continue;
+			}
+			int x0 = tx << TILE_SHIFT, y0 = ty << TILE_SHIFT;
+			int w = img->w - x0 < TILE_SIZE ? img->w - x0 : TILE_SIZE;
+			int h = img->h - y0 < TILE_SIZE ? img->h - y0 : TILE_SIZE;
+			for (int y = y0; y < y0 + h; ++y) {
+				const unsigned char *p = imagemap_row(img->map, img, y) + x0 * 4;
+				uintptr_t start = (uintptr_t) p & ~pagemask;
+				posix_madvise((void *) start, (uintptr_t) p + w * 4 - start, POSIX_MADV_WILLNEED);
+			}
+		}
+	}
+}
+
+int
+to_image(struct editor *ed, int v)
+{
+	return ed->zoom >= 0 ? v << ed->zoom : v >> -ed->zoom;
+}
+
+int
+to_view(struct editor *ed, int v)
+{
+	return ed->zoom >= 0 ? v >> ed->zoom : v << -ed->zoom;
+}
+
+int
+undo(struct editor *ed)
+{
+	undo_commit(ed);
+	if (!ed->undo) return 1;
+	struct undo *op = ed->undo;
+	if (undo_unpack(ed, op) < 0 || undo_swap(ed, op) < 0) return -1;
+	ed->undo = op->prev;
+	undo_trim(ed, op);
+	return 0;
+}
+
+void
+undo_commit(struct editor *ed)
+{
+	struct undo *op = ed->op;
+	if (!op) return;
+	ed->op = NULL;
+	++ed->opstamp;
+	// Whatever was undone can't be redone after something new was done
+	struct undo *redo = ed->undo ? ed->undo->next : ed->history;
+	while (redo) {
+		struct undo *next = redo->next;
+		undo_free(ed, redo);
+		redo = next;
+	}
+	op->prev = ed->undo;
+	if (ed->undo) {
+		ed->undo->next = op;
+	} else {
+		ed->history = op;
+	}
+	ed->undo = op;
+	undo_trim(ed, op);
+}
+
+void
+undo_free(struct editor *ed, struct undo *op)
+{
+	for (int i = 0; i < op->n; ++i) {
+		if (op->tiles[i]) {
+			tile_unref(op->tiles[i]);
+			ed->undobytes -= sizeof(struct tile);
+		} else if (op->packed[i].off < 0) {
+			free(op->packed[i].data);
+			ed->undobytes -= op->packed[i].len;
+		} else {
+			ed->spilllive -= op->packed[i].len;
+		}
+	}
+	if (ed->spill && ed->spilllive == 0) ed->spillend = 0;
+	free(op->idx);
+	free(op->tiles);
+	free(op->packed);
+	free(op);
+}
+
+void
+undo_pack(struct editor *ed, struct undo *op)
+{
+	op->packed = calloc(op->n, sizeof(struct packedtile));
+	if (!op->packed) return;
+	for (int i = 0; i < op->n; ++i) {
+		struct tile *t = op->tiles[i];
+		op->packed[i].off = -1;
+		// Tiles still in use elsewhere would only be duplicated
+		if (t->refs > 1) continue;
+		int len;
+		unsigned char *data = stbi_zlib_compress((unsigned char *) t->px, sizeof(t->px), &len, 5);
+		if (!data) continue;
+		op->packed[i].data = data;
+		op->packed[i].len = len;
+		op->tiles[i] = NULL;
+		tile_unref(t);
+		ed->undobytes += len;
+		ed->undobytes -= sizeof(struct tile);
+	}
+}
+
+int
+undo_spill(struct editor *ed, struct undo *op)
+{
+	// The space of spilled operations is only reused once they are all gone,
+	// which happens soon enough since the oldest ones go first
+	long len = 0;
+	for (int i = 0; i < op->n; ++i) {
+		if (!op->tiles[i] && op->packed[i].off < 0) len += op->packed[i].len;
+	}
+	if (ed->spillend + len > (long) g.spilllimit) return -1;
+	if (!ed->spill && !(ed->spill = tmpfile())) return -1;
+	if (fseek(ed->spill, ed->spillend, SEEK_SET) < 0) return -1;
+	for (int i = 0; i < op->n; ++i) {
+		struct packedtile *p = &op->packed[i];
+		if (op->tiles[i] || p->off >= 0) continue;
+		if (fwrite(p->data, 1, p->len, ed->spill) != (size_t) p->len) return -1;
+		free(p->data);
+		p->data = NULL;
+		p->off = ed->spillend;
+		ed->spillend += p->len;
+		ed->spilllive += p->len;
+		ed->undobytes -= p->len;
+	}
+	op->spilled = 1;
+	return 0;
+}
+
+int
+undo_swap(struct editor *ed, struct undo *op)
+{
+	// The tiles swapped out must be read first, as they're kept in the operation
+	for (int i = 0; i < op->n; ++i) {
+		image_tile(&ed->img, op->idx[i]);
+		if (!ed->img.tiles[op->idx[i]]) return -1;
+	}
+	for (int i = 0; i < op->n; ++i) {
+		int idx = op->idx[i];
+		struct tile *t = image_tile(&ed->img, idx);
+		ed->img.tiles[idx] = op->tiles[i];
+		op->tiles[i] = t;
+		image_dirty(&ed->img, idx);
+		int x = (idx % ed->img.tw) << TILE_SHIFT, y = (idx / ed->img.tw) << TILE_SHIFT;
+		image_changed(ed, x, y, TILE_SIZE, TILE_SIZE);
+	}
+	return 0;
+}
+
+void
+undo_trim(struct editor *ed, struct undo *keep)
+{
+	// Only the operations just before keep are left uncompressed. keep moves by one
+	// operation at a time, so the ones before the first compressed one already are.
+	int age = 0;
+	for (struct undo *o = keep; o; o = o->prev, ++age) {
+		if (age < UNDO_RAW_OPS) continue;
+		if (o->packed) break;
+		undo_pack(ed, o);
+	}
+	// When over the limit, compress the oldest other operations, then spill them
+	// to disk while there's room there, and then forget the ones before keep. The
+	// oldest operations not compressed or spilled yet are kept track of, as the
+	// ones before them stay that way.
+	struct undo *pack = ed->history, *spill = ed->history;
+	while (ed->undobytes > g.undolimit) {
+		for (; pack && (pack == keep || pack->packed); pack = pack->next);
+		if (pack) {
+			undo_pack(ed, pack);
+			pack = pack->next;
+			continue;
+		}
+		for (; spill && (spill == keep || spill->spilled || !spill->packed); spill = spill->next);
+		if (spill && undo_spill(ed, spill) == 0) continue;
+		if (ed->history == keep) break;
+		struct undo *oldest = ed->history;
+		if (spill == oldest) spill = oldest->next;
+		ed->history = oldest->next;
+		ed->history->prev = NULL;
+		if (ed->undo == oldest) ed->undo = NULL;
+		undo_free(ed, oldest);
+	}
+}
+
+int
+undo_unpack(struct editor *ed, struct undo *op)
+{
+	if (!op->packed) return 0;
+	for (int i = 0; i < op->n; ++i) {
+		struct packedtile *p = &op->packed[i];
+		if (op->tiles[i]) continue;
+		unsigned char *data = p->data;
+		if (p->off >= 0) {
+			data = malloc(p->len);
+			if (!data || fseek(ed->spill, p->off, SEEK_SET) < 0 || fread(data, 1, p->len, ed->spill) != (size_t) p->len) {
+				free(data);
+				return -1;
+			}
+		}
+		struct tile *t = malloc(sizeof(struct tile));
+		int r = t ? stbi_zlib_decode_buffer((char *) t->px, sizeof(t->px), (char *) data, p->len) : -1;
+		// The compressed tile stays until it's no longer needed, in case this fails
+		if (p->off >= 0) free(data);
+		if (r != sizeof(t->px)) {
+			free(t);
+			return -1;
+		}
+		t->refs = 1;
+		op->tiles[i] = t;
+		ed->undobytes += sizeof(struct tile);
+		if (p->off >= 0) {
+			ed->spilllive -= p->len;
+		} else {
+			free(p->data);
+			ed->undobytes -= p->len;
+		}
+	}
+	if (ed->spill && ed->spilllive == 0) ed->spillend = 0;
+	free(op->packed);
+	op->packed = NULL;
+	op->spilled = 0;
+	return 0;
+}
+
+void
+view_blit(struct editor *ed)
+{
+	ncplane_erase(g.viewplane);
+	ncplane_erase(g.pixplane);
+	int vx = to_view(ed, ed->viewx), vy = to_view(ed, ed->viewy);
+	int w = ed->zw - vx, h = ed->zh - vy;
+	if (w > g.viewpw) w = g.viewpw;
+	if (h > g.viewph) h = g.viewph;
+	// Without the memory for the bitmap the frame is left blank
+	struct rgba *buf = malloc((size_t) w * h * sizeof(struct rgba));
+	if (!buf) return;
+	for (int y = 0; y < h; ++y) {
+		view_row(ed, vx, vy + y, w, &buf[y*w]);
+	}
+	// A single pixel is too small to spot, so mark the cursor with an inverted
+	// cross around it, leaving the pixel itself intact
+	static const int cross[8][2] = { {-2, 0}, {-1, 0}, {1, 0}, {2, 0}, {0, -2}, {0, -1}, {0, 1}, {0, 2} };
+	int curx = to_view(ed, ed->curx) - vx, cury = to_view(ed, ed->cury) - vy;
+	for (int i = 0; i < 8; ++i) {
+		int x = curx + cross[i][0], y = cury + cross[i][1];
+		if (x < 0 || y < 0 || x >= w || y >= h) continue;
+		struct rgba *p = &buf[x + y*w];
+		p->r = 255 - p->r;
+		p->g = 255 - p->g;
+		p->b = 255 - p->b;
+	}
+	struct ncvisual *ncv = ncvisual_from_rgba(buf, h, w * sizeof(struct rgba), w);
+	free(buf);
+	if (!ncv) return;
+	ncvisual_blit(g.nc, ncv, &(struct ncvisual_options) {
+		.n = g.pixplane,
+		.scaling = NCSCALE_NONE,
+		.blitter = NCBLIT_PIXEL
+	});
+	ncvisual_destroy(ncv);
+}
+
+int
+view_cursor_at(struct editor *ed, int x, int y)
+{
+	if (ed->zoom >= 0) return x == to_view(ed, ed->curx) && y == to_view(ed, ed->cury);
+	return to_image(ed, x) == ed->curx && to_image(ed, y) == ed->cury;
+}
+
+void
+view_draw(struct editor *ed, int x, int y, int w, int h)
+{
+	// Clip the region (in view pixels) to what is visible
+	int vx = to_view(ed, ed->viewx), vy = to_view(ed, ed->viewy);
+	int xupto = x + w, yupto = y + h;
+	if (x < vx) x = vx;
+	if (y < vy) y = vy;
+	if (xupto > vx + g.viewpw) xupto = vx + g.viewpw;
+	if (yupto > vy + g.viewph) yupto = vy + g.viewph;
+	if (xupto > ed->zw) xupto = ed->zw;
+	if (yupto > ed->zh) yupto = ed->zh;
+	if (x >= xupto || y >= yupto) return;
+	// Then widen it to whole blocks
+	int bx0 = (x - vx) / g.blockpw, bx1 = (xupto - vx + g.blockpw - 1) / g.blockpw;
+	int by0 = (y - vy) / g.blockph, by1 = (yupto - vy + g.blockph - 1) / g.blockph;
+	// The pixels of each row of blocks are fetched a row at a time, up to the edge
+	// of the image, which the blocks only look at up to
+	int x0 = vx + bx0 * g.blockpw, stride = (bx1 - bx0) * g.blockpw;
+	int n = ed->zw - x0 < stride ? ed->zw - x0 : stride;
+	struct rgba *buf = malloc(stride * g.blockph * sizeof(struct rgba));
+	if (!buf) return;
+	for (int by = by0; by < by1; ++by) {
+		int y0 = vy + by * g.blockph;
+		for (int i = 0; i < g.blockph && y0 + i < ed->zh; ++i) {
+			view_row(ed, x0, y0 + i, n, &buf[i * stride]);
+		}
+		for (int bx = bx0; bx < bx1; ++bx) {
+			RENDERMODES[g.render].drawfn(
+				ed, &buf[(bx - bx0) * g.blockpw], stride,
+				vx + bx * g.blockpw, y0,
+				bx * g.blockcw, by * g.blockch
+			);
+		}
+	}
+	free(buf);
+}
+
+void
+view_row(struct editor *ed, int x, int y, int n, struct rgba *out)
+{
+	// Gets n view pixels of row y from x on. Zoomed in, each image pixel covers
+	// several view pixels, and they're taken from the tiles a row segment at a time.
+	if (ed->load && !ed->loadpass && to_image(ed, y) >= ed->loadrows) {
+		memset(out, 0, n * sizeof(struct rgba));
+		return;
+	}
+	if (ed->zoom > 0) {
+		struct mipmap *m = &ed->mips[ed->zoom - 1];
+		memcpy(out, &m->data[x + (size_t) y * m->w], n * sizeof(struct rgba));
+		return;
+	}
+	int iy = to_image(ed, y);
+	for (int i = 0; i < n; ) {
+		int ix = to_image(ed, x + i), k;
+		const struct rgba *row = image_row(&ed->img, ix, iy, &k);
+		for (int j = 0; j < k && i < n; ++j) {
+			for (; i < n && to_image(ed, x + i) == ix + j; ++i) out[i] = row[j];
+		}
+	}
+}
+
+void
+view_scroll(struct editor *ed, int dx, int dy)
+{
+	// Shift the cells already on viewplane by (-dx, -dy) view pixels, which must be whole blocks. Resizing while
+	// keeping a region preserves its position on the screen and blanks the rest,
+	// so keep the part that stays visible and then move the plane back in place.
+	int cdx = dx / g.blockpw * g.blockcw;
+	int cdy = dy / g.blockph * g.blockch;
+	ncplane_resize(
+		g.viewplane,
+		cdy > 0 ? cdy : 0, cdx > 0 ? cdx : 0,
+		g.viewh - abs(cdy), g.vieww - abs(cdx),
+		cdy < 0 ? cdy : 0, cdx < 0 ? cdx : 0,
+		g.viewh, g.vieww
+	);
+	ncplane_move_yx(g.viewplane, 1, 0);
+	// Only the newly exposed strips need to be drawn
+	int vx = to_view(ed, ed->viewx), vy = to_view(ed, ed->viewy);
+	int pw = g.viewpw, ph = g.viewph;
+	if (dx > 0) view_draw(ed, vx + pw - dx, vy, dx, ph);
+	if (dx < 0) view_draw(ed, vx, vy, -dx, ph);
+	if (dy > 0) view_draw(ed, vx, vy + ph - dy, pw, dy);
+	if (dy < 0) view_draw(ed, vx, vy, pw, -dy);
+}
+
+void *
+worker_main(void *arg)
+{
+	(void) arg;
+	pthread_mutex_lock(&g.jobmutex);
+	while (1) {
+		while (!g.jobs && !g.jobsstopped) pthread_cond_wait(&g.jobcond, &g.jobmutex);
+		if (g.jobsstopped) break;
+		struct job *job = g.jobs;
+		g.jobs = job->next;
+		if (!g.jobs) g.jobstail = NULL;
+		pthread_mutex_unlock(&g.jobmutex);
+		job->fn(job);
+		pthread_mutex_lock(&g.jobmutex);
+		if (job->batch) {
+			if (--job->batch->pending == 0) pthread_cond_broadcast(&g.batchcond);
+			continue;
+		}
+		job->next = g.donejobs;
+		g.donejobs = job;
+		jobs_wake();
+	}
+	pthread_mutex_unlock(&g.jobmutex);
+	return NULL;
+}
+
+void
+jobfn_floodtile(struct job *job)
+{
+	struct floodtile *ft = (struct floodtile *) job;
+	struct flood *flood = ft->flood;
+	struct tile *t = flood->img->tiles[ft->i];
+	unsigned char *filled = flood->filled[ft->i];
+	int tx0 = (ft->i % flood->img->tw) << TILE_SHIFT;
+	int tx1 = (tx0 + TILE_SIZE < flood->img->w ? tx0 + TILE_SIZE : flood->img->w) - 1;
+	int diag = flood->diag;
+	while (ft->seeds.n && !ft->failed) {
+		--ft->seeds.n;
+		int x0 = ft->seeds.span[ft->seeds.n][0], x1 = ft->seeds.span[ft->seeds.n][1], y = ft->seeds.span[ft->seeds.n][2];
+		for (int x = x0; x <= x1; ++x) {
+			if (!floodtile_match(flood, x, y)) continue;
+			int lx = x, rx = x;
+			while (lx > tx0 && floodtile_match(flood, lx - 1, y)) --lx;
+			while (rx < tx1 && floodtile_match(flood, rx + 1, y)) ++rx;
+			for (int i = lx; i <= rx; ++i) {
+				int j = (i & TILE_MASK) + ((y & TILE_MASK) << TILE_SHIFT);
+				t->px[j] = flood->rgba;
+				filled[j >> 3] |= 1 << (j & 7);
+			}
+			if (lx < ft->x0) ft->x0 = lx;
+			if (rx > ft->x1) ft->x1 = rx;
+			if (y < ft->y0) ft->y0 = y;
+			if (y > ft->y1) ft->y1 = y;
+			int ok = (lx > tx0 || floodtile_push(ft, lx - 1, lx - 1, y))
+				&& (rx < tx1 || floodtile_push(ft, rx + 1, rx + 1, y))
+				&& floodtile_push(ft, lx - diag, rx + diag, y - 1)
+				&& floodtile_push(ft, lx - diag, rx + diag, y + 1);
+			if (!ok) ft->failed = 1;
+			x = rx + 1;
+		}
+	}
+}
+
+void
+jobfn_load(struct job *job)
+{
+	struct loadjob *lj = (struct loadjob *) job;
+	int w, h;
+	if (imagemap_open(lj->filepath, &lj->img) == 0) return;
+	if (qoi_info(lj->filepath, &w, &h)) {
+		lj->failed = qoi_load(lj->filepath, &lj->img, lj) < 0 && lj->img.tiles;
+		return;
+	}
+	if ((lj->damaged = png_load(lj->filepath, &lj->img, lj)) >= 0) return;
+	lj->damaged = 0;
+	void *data = stbi_load(lj->filepath, &w, &h, NULL, 4);
+	if (!data) return;
+	image_from_rgba(&lj->img, data, w, h);
+	stbi_image_free(data);
+}
+
+void
+donefn_load(struct job *job)
+{
+	struct loadjob *lj = (struct loadjob *) job;
+	struct editor *ed = lj->ed;
+	--g.loading;
+	pthread_mutex_destroy(&lj->lock);
+	if (ed) ed->load = NULL;
+	if (!ed || g.jobsstopped) {
+		image_free(&lj->img);
+	} else if (!lj->img.tiles || lj->failed) {
+		image_free(&lj->img);
+		ed->img.tiles = NULL;
+		char msg[64];
+		snprintf(msg, sizeof(msg), "Failed to load %.40s", lj->filepath);
+		message(msg);
+		if (g.shown == ed) g.shown = NULL;
+		free_editor(ed);
+		nctabbed_del(g.tabbed, lj->tab);
+	} else {
+		ed->img = lj->img;
+		ed->tilestamp = calloc(ed->img.tw * ed->img.th, sizeof(unsigned));
+		ed->img.used = calloc(ed->img.tw * ed->img.th, sizeof(unsigned));
+		if (lj->damaged) {
+			char msg[64];
+			snprintf(msg, sizeof(msg), "%.40s is damaged", lj->filepath);
+			message(msg);
+		}
+		if (ed->loadpass || ed->loadrows) {
+			damage(ed, 0, 0, ed->img.w, ed->img.h);
+		} else {
+			set_zoom(ed, 0);
+		}
+	}
+	free(lj->filepath);
+	free(lj);
+}
+
+void
+jobfn_pngband(struct job *job)
+{
+	struct pngband *b = (struct pngband *) job;
+	int n = b->img->w * 4, stride = n + 1;
+	size_t rawlen = (size_t) (b->y1 - b->y0) * stride;
+	// Both rows are preceded by zeros for the filters to look at
+	unsigned char *raw = malloc(rawlen), *rows = calloc(1, 2 * (n + 16) + 4 * n);
+	struct deflate *d = malloc(sizeof(struct deflate));
+	if (!raw || !rows || !d) goto end;
+	// Each row is filtered against the one above it, even across bands
+	unsigned char *prev = rows + 16, *cur = rows + n + 32, *tmp = rows + 2*n + 32;
+	for (int y = b->y0 ? b->y0 - 1 : b->y0; y < b->y1; ++y) {
+		for (int x = 0, k; x < b->img->w; x += k) {
+			struct rgba *row = image_row(b->img, x, y, &k);
+			memcpy(cur + x*4, row, k * 4);
+		}
+		if (y >= b->y0) png_filter(cur, prev, n, b->level, raw + (size_t) (y - b->y0) * stride, tmp);
+		unsigned char *t = prev;
+		prev = cur;
+		cur = t;
+	}
+	b->adler = adler32(1, raw, rawlen);
+	b->rawlen = rawlen;
+	
+	deflate_init(d, b->level);
+	int r = 0;
+	if (b->y0 == 0) {
+		// The zlib header goes in front of the first band
+		int flevel = b->level < 2 ? 0 : b->level < 6 ? 1 : b->level == 6 ? 2 : 3;
+		int flg = flevel << 6;
+		flg += 31 - (0x78 << 8 | flg) % 31;
+		r = deflate_put(d, 0x78, 8) < 0 || deflate_put(d, flg, 8) < 0 ? -1 : 0;
+	}
+	if (r == 0 && deflate_band(d, raw, rawlen) == 0) {
+		b->out = d->out;
+		b->len = d->len;
+		b->crc = crc32_update(crc32_update(~0u, (const unsigned char *) "IDAT", 4), b->out, b->len);
+	} else {
+		free(d->out);
+	}
+end:
+	free(d);
+	free(rows);
+	free(raw);
+	if (b->save) {
+		pthread_mutex_lock(&g.jobmutex);
+		int done = ++*b->bandsdone;
+		pthread_mutex_unlock(&g.jobmutex);
+		job_progress(b->save, 100 * done / b->nbands);
+	}
+}
+
+void
+jobfn_save(struct job *job)
+{
+	struct savejob *sj = (struct savejob *) job;
+	int (*savefn)(const char *, struct image *, struct job *) = FORMATS[sj->format].savefn;
+	if (sj->img.failed) {
+		sj->result = 0;
+		return;
+	}
+	if (!sj->img.map && !sj->img.slots) {
+		sj->result = savefn(sj->filepath, &sj->img, job);
+		return;
+	}
+	if (sj->img.map && (sj->result = imagemap_save(sj->filepath, sj->format, &sj->img, job)) >= 0) {
+		sj->inplace = 1;
+		return;
+	}
+	// Tiles that weren't read yet still come from the mapped file or the scratch
+	// file, so it's replaced rather than overwritten, and only if they all could be
+	size_t len = strlen(sj->filepath);
+	char *tmp = malloc(len + 5);
+	if (!tmp) {
+		sj->result = 0;
+		return;
+	}
+	memcpy(tmp, sj->filepath, len);
+	memcpy(tmp + len, ".tmp", 5);
+	sj->result = savefn(tmp, &sj->img, job) && !__atomic_load_n(&sj->img.failed, __ATOMIC_RELAXED) && rename(tmp, sj->filepath) == 0;
+	if (!sj->result) remove(tmp);
+	free(tmp);
+}
+
+void
+donefn_save(struct job *job)
+{
+	struct savejob *sj = (struct savejob *) job;
+	// A save that didn't get to run before quitting is still wanted
+	if (sj->result < 0) jobfn_save(job);
+	if (sj->ed) {
+		sj->ed->save = NULL;
+		// Tiles that haven't changed since are now what's in the file
+		struct image *img = &sj->ed->img;
+		for (int i = 0; sj->result && sj->inplace && i < img->tw * img->th; ++i) {
+			if (img->tiles[i] == sj->img.tiles[i]) img->dirty[i] = 0;
+		}
+	}
+	message(sj->result ? "Saved" : "Saving failed");
+	image_free(&sj->img);
+	free(sj->filepath);
+	free(sj);
+}
+
+void
+drawfn_cell(struct editor *ed, const struct rgba *px, int stride, int x, int y, int cx, int cy)
+{
+	struct rgba rgba = *px;
+	ncplane_set_bg_rgb8(g.viewplane, rgba.r, rgba.g, rgba.b);
+	if (view_cursor_at(ed, x, y)) {
+		ncplane_set_fg_rgb8(g.viewplane, 255 - rgba.r, 255 - rgba.g, 255 - rgba.b);
+		ncplane_putstr_yx(g.viewplane, cy, cx, "[]");
+		ncplane_set_fg_default(g.viewplane);
+	} else {
+		ncplane_putstr_yx(g.viewplane, cy, cx, "  ");
+	}
+}
+
+void
+drawfn_half(struct editor *ed, const struct rgba *px, int stride, int x, int y, int cx, int cy)
+{
+	static const char *glyphs[4] = { " ", "▀", "▄", "█" };
+	ncplane_putstr_yx(g.viewplane, cy, cx, glyphs[block_split(ed, px, stride, x, y, 1, 2)]);
+}
+
+void
+drawfn_quadrant(struct editor *ed, const struct rgba *px, int stride, int x, int y, int cx, int cy)
+{
+	static const char *glyphs[16] = {
+		" ", "▘", "▝", "▀", "▖", "▌", "▞", "▛",
+		"▗", "▚", "▐", "▜", "▄", "▙", "▟", "█",
+	};
+	ncplane_putstr_yx(g.viewplane, cy, cx, glyphs[block_split(ed, px, stride, x, y, 2, 2)]);
+}
+
+void
+drawfn_sextant(struct editor *ed, const struct rgba *px, int stride, int x, int y, int cx, int cy)
+{
+	unsigned mask = block_split(ed, px, stride, x, y, 2, 3);
+	if (mask == 0) {
+		ncplane_putstr_yx(g.viewplane, cy, cx, " ");
+	} else if (mask == 21) {
+		ncplane_putstr_yx(g.viewplane, cy, cx, "▌");
+	} else if (mask == 42) {
+		ncplane_putstr_yx(g.viewplane, cy, cx, "▐");
+	} else if (mask == 63) {
+		ncplane_putstr_yx(g.viewplane, cy, cx, "█");
+	} else {
+		// The sextants start at U+1FB00, skipping the ones that are half blocks
+		uint32_t c = 0x1FB00 + mask - 1 - (mask > 21) - (mask > 42);
+		char utf8[5] = {
+			0xF0 | c >> 18,
+			0x80 | (c >> 12 & 0x3F),
+			0x80 | (c >> 6 & 0x3F),
+			0x80 | (c & 0x3F),
+			0
+		};
+		ncplane_putstr_yx(g.viewplane, cy, cx, utf8);
+	}
 }
 
 int
-savefn_jpg(char const *filepath, int w, int h, int comp, const void *data)
+savefn_bmp(const char *filepath, struct image *img, struct job *job)
 {
-	return stbi_write_png(filepath, w, h, comp, data, w * comp);
+	struct rgba *data = image_flatten(img, job);
+	if (!data) return 0;
+	int r = stbi_write_bmp(filepath, img->w, img->h, 4, data);
+	free(data);
+	return r;
 }
 
 int
-savefn_png(char const *filepath, int w, int h, int comp, const void *data)
+savefn_jpg(const char *filepath, struct image *img, struct job *job)
 {
-	return stbi_write_jpg(filepath, w, h, comp, data, 95);
+	struct rgba *data = image_flatten(img, job);
+	if (!data) return 0;
+	int r = stbi_write_jpg(filepath, img->w, img->h, 4, data, 95);
+	free(data);
+	return r;
+}
+
+int
+savefn_png(const char *filepath, struct image *img, struct job *job)
+{
+	// Bands of rows are filtered and compressed in parallel, each into blocks
+	// ending on a byte boundary, and then joined into one zlib stream with one
+	// IDAT chunk per band
+	int bandh = PNG_BAND_BYTES / (img->w * 4 + 1) + 1;
+	int nbands = (img->h + bandh - 1) / bandh, bandsdone = 0;
+	struct pngband *bands = calloc(nbands, sizeof(struct pngband));
+	struct job **jobs = calloc(nbands, sizeof(struct job *));
+	int ok = 0;
+	FILE *f = NULL;
+	if (!bands || !jobs) goto end;
+	for (int i = 0; i < nbands; ++i) {
+		struct pngband *b = &bands[i];
+		b->job.fn = jobfn_pngband;
+		b->img = img;
+		b->y0 = i * bandh;
+		b->y1 = b->y0 + bandh < img->h ? b->y0 + bandh : img->h;
+		b->level = g.pnglevel;
+		b->save = job;
+		b->bandsdone = &bandsdone;
+		b->nbands = nbands;
+		jobs[i] = &b->job;
+	}
+	jobs_run(jobs, nbands);
+	
+	// The stream ends with an empty final block and the checksum of it all
+	uint32_t adler = 1;
+	for (int i = 0; i < nbands; ++i) {
+		if (!bands[i].out) goto end;
+		adler = adler32_combine(adler, bands[i].adler, bands[i].rawlen);
+	}
+	struct pngband *last = &bands[nbands - 1];
+	unsigned char *out = realloc(last->out, last->len + 6);
+	if (!out) goto end;
+	last->out = out;
+	unsigned char trailer[6] = { 0x03, 0x00, adler >> 24, adler >> 16, adler >> 8, adler };
+	memcpy(last->out + last->len, trailer, 6);
+	last->len += 6;
+	last->crc = crc32_update(last->crc, trailer, 6);
+	
+	if (!(f = fopen(filepath, "wb"))) goto end;
+	unsigned char ihdr[13] = {
+		img->w >> 24, img->w >> 16, img->w >> 8, img->w,
+		img->h >> 24, img->h >> 16, img->h >> 8, img->h,
+		8, 6, 0, 0, 0 // 8 bit RGBA, no interlacing
+	};
+	if (fwrite("\x89PNG\r\n\x1a\n", 1, 8, f) != 8 || png_chunk(f, "IHDR", ihdr, 13, NULL) < 0) goto end;
+	for (int i = 0; i < nbands; ++i) {
+		if (png_chunk(f, "IDAT", bands[i].out, bands[i].len, &bands[i].crc) < 0) goto end;
+	}
+	ok = png_chunk(f, "IEND", NULL, 0, NULL) == 0;
+end:
+	if (f && fclose(f) != 0) ok = 0;
+	for (int i = 0; bands && i < nbands; ++i) {
+		free(bands[i].out);
+	}
+	free(bands);
+	free(jobs);
+	return ok;
+}
+
+int
+savefn_qoi(const char *filepath, struct image *img, struct job *job)
+{
+	// The "Quite OK Image" format, much faster to write and read than PNG while
+	// still lossless. Pixels are encoded a row at a time, straight from the tiles.
+	FILE *f = fopen(filepath, "wb");
+	if (!f) return 0;
+	unsigned char *buf = malloc((size_t) img->w * 5 + 16);
+	unsigned char head[14] = {
+		'q', 'o', 'i', 'f',
+		img->w >> 24, img->w >> 16, img->w >> 8, img->w,
+		img->h >> 24, img->h >> 16, img->h >> 8, img->h,
+		4, 0 // RGBA, sRGB with linear alpha
+	};
+	int ok = buf && fwrite(head, 1, 14, f) == 14;
+	struct rgba prev = { 0, 0, 0, 255 }, index[64] = {};
+	int run = 0;
+	for (int y = 0; ok && y < img->h; ++y) {
+		unsigned char *p = buf;
+		for (int x = 0, n; x < img->w; x += n) {
+			struct rgba *row = image_row(img, x, y, &n);
+			for (int i = 0; i < n; ++i) {
+				struct rgba px = row[i];
+				if (!memcmp(&px, &prev, sizeof(px))) {
+					if (++run == 62) {
+						*p++ = 0xC0 | (run - 1);
+						run = 0;
+					}
+					continue;
+				}
+				if (run) {
+					*p++ = 0xC0 | (run - 1);
+					run = 0;
+				}
+				int h = (px.r * 3 + px.g * 5 + px.b * 7 + px.a * 11) % 64;
+				if (!memcmp(&index[h], &px, sizeof(px))) {
+					*p++ = h;
+				} else {
+					index[h] = px;
+					int8_t dr = px.r - prev.r, dg = px.g - prev.g, db = px.b - prev.b;
+					int8_t drg = dr - dg, dbg = db - dg;
+					if (px.a != prev.a) {
+						*p++ = 0xFF;
+						*p++ = px.r;
+						*p++ = px.g;
+						*p++ = px.b;
+						*p++ = px.a;
+					} else if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+						*p++ = 0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2);
+					} else if (dg >= -32 && dg <= 31 && drg >= -8 && drg <= 7 && dbg >= -8 && dbg <= 7) {
+						*p++ = 0x80 | (dg + 32);
+						*p++ = (drg + 8) << 4 | (dbg + 8);
+					} else {
+						*p++ = 0xFE;
+						*p++ = px.r;
+						*p++ = px.g;
+						*p++ = px.b;
+					}
+				}
+				prev = px;
+			}
+		}
+		if (run && y == img->h - 1) *p++ = 0xC0 | (run - 1);
+		if (y == img->h - 1) {
+			static const unsigned char padding[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+			memcpy(p, padding, 8);
+			p += 8;
+		}
+		ok = fwrite(buf, 1, p - buf, f) == (size_t) (p - buf);
+		if (job && (y & TILE_MASK) == TILE_MASK) job_progress(job, 100 * y / img->h);
+	}
+	free(buf);
+	if (fclose(f) != 0) ok = 0;
+	return ok;
+}
+
+int
+savefn_tga(const char *filepath, struct image *img, struct job *job)
+{
+	struct rgba *data = image_flatten(img, job);
+	if (!data) return 0;
+	int r = stbi_write_tga(filepath, img->w, img->h, 4, data);
+	free(data);
+	return r;
 }
 
 int
 main(int argc, char **argv)
 {
-	init();
+	if (init() < 0) return 1;
 	int optsdone = 0;
-	for (int i = 1; i < argc; ++i) {
+	char badopt = 0;
+	long mibmax = (long) (SIZE_MAX >> 20);
+	for (int i = 1; i < argc && !badopt; ++i) {
 		char *arg = argv[i];
 		if (arg[0] != '-' || optsdone) {
 			open_file(arg);
@@ -544,14 +4560,46 @@ main(int argc, char **argv)
 			}
 		} else if (arg[1] != '-') {
 			char *sopts = &arg[1];
+			for (; *sopts && !badopt; ++sopts) {
+				char *val = i + 1 < argc ? argv[i + 1] : NULL;
+				long n = 0;
+				switch (*sopts) {
+				case 'j': {
+					if ((n = option_num(val, 1, MAX_WORKERS)) >= 0) g.nworkers = n;
+				} break;
+				case 'z': {
+					if ((n = option_num(val, 0, 9)) >= 0) g.pnglevel = n;
+				} break;
+				case 's': {
+					if ((n = option_num(val, 0, mibmax)) >= 0) g.spilllimit = (size_t) n << 20;
+				} break;
+				case 'm': {
+					if ((n = option_num(val, 1, mibmax)) >= 0) g.tilelimit = (size_t) n << 20;
+				} break;
+				case 'u': {
+					if ((n = option_num(val, 1, mibmax)) >= 0) g.undolimit = (size_t) n << 20;
+				} break;
+				default:
+					continue;
+				}
+				if (n < 0) badopt = *sopts;
+				else ++i;
+			}
 		}
 	}
-	if (nctabbed_tabcount(g.tabbed) == 0) {
+	if (badopt) {
+		// Notcurses has to let go of the terminal before anything is printed
+		cleanup();
+		fprintf(stderr, "tpe: bad or missing value for -%c\n", badopt);
+		fprintf(stderr, "usage: tpe [-j threads] [-z level] [-m MiB] [-u MiB] [-s MiB] [--] file...\n");
+		return 2;
+	}
+	if (g.loading == 0) {
 		cleanup();
 		return 1;
 	}
-	nctabbed_select(g.tabbed, nctabbed_leftmost(g.tabbed));
-	main_loop();
+	jobs_start(g.nworkers);
+	int r = main_loop();
 	cleanup();
-	return 0;
+	return r < 0;
 }